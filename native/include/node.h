@@ -38,6 +38,7 @@
  */
 
 #define NODEEXE ".nodes"
+#define NODEHOTEXE ".nodehots"
 
 #ifndef MEM_T
 typedef struct mem mem_t; 
@@ -71,13 +72,34 @@ struct nodemess {
 
     /* part updated in httpd */
     int id;                   /* id in table and worker id */
-    apr_time_t updatetimelb; /* time of last update of the lbstatus value */
-    int num_failure_idle;    /* number of time the cping/cpong failed while calculating the lbstatus value */
-    int oldelected;          /* value of s->elected when calculating the lbstatus */
     apr_time_t lastcleantry; /* time of last unsuccessful try to clean the worker in proxy part */
 };
 typedef struct nodemess nodemess_t; 
 
+#define NODEHOTSZ 64 /* a cache line */
+
+/*
+ * part of the node read or written by httpd for each request, kept in its
+ * own table (indexed by the id of the node) one cache line per node.
+ * lbfactor, lbstatus, elected, busy and status are in the proxy_worker_shared
+ * of mod_proxy (stat in nodeinfo_t).
+ */
+struct nodehot {
+    apr_uint32_t generation; /* copy of the generation of the node slot */
+    unsigned int domain;     /* apr_hashfunc_default() of mess.Domain | 1 (0 no domain) */
+    int oldelected;          /* value of s->elected when calculating the lbstatus */
+    int num_failure_idle;    /* number of time the cping/cpong failed while calculating the lbstatus value */
+    apr_time_t updatetimelb; /* time of last update of the lbstatus value */
+    /* passive outlier detection, fed by each proxied request (apr_atomic) */
+    apr_uint32_t ewma_latency;  /* moving average of the response time in microseconds */
+    apr_uint32_t ewma_errors;   /* moving average of the 5xx responses (65536 = all) */
+    apr_uint32_t ejected_until; /* apr_time_sec() until the node doesn't get new requests */
+    apr_uint32_t ejections;     /* consecutive ejections (exponential back-off) */
+    apr_uint32_t slowstart;     /* apr_time_sec() when the node joined or came back (weight ramp) */
+    char pad[NODEHOTSZ - 9 * sizeof(int) - sizeof(apr_time_t)];
+};
+typedef struct nodehot nodehot_t;
+
 #define SIZEOFSCORE 1600 /* at least size of the proxy_worker_stat structure */
 
 /* status of the node as read/store in httpd. */
@@ -87,6 +109,8 @@ struct nodeinfo {
     /* filled by httpd */
     apr_time_t updatetime;   /* time of last received message */
     unsigned long offset;    /* offset to the proxy_worker_stat structure */
+    apr_uint32_t seq;        /* seqlock: odd while mod_manager rewrites the record */
+    apr_uint32_t generation; /* changed each time the slot is given to another node */
     char stat[SIZEOFSCORE];  /* to store the status */ 
 };
 typedef struct nodeinfo nodeinfo_t; 
@@ -108,6 +132,24 @@ apr_status_t get_last_mem_error(mem_t *mem);
  */
 apr_status_t insert_update_node(mem_t *s, nodeinfo_t *node, int *id);
 
+/**
+ * change a node record of the shared table in place (seqlock)
+ * @param pointer to the shared table.
+ * @param node the node record in the shared table.
+ * @param route new JVMRoute (NULL: unchanged).
+ * @param remove 1 to mark the node removed (0: unchanged).
+ * @param lastcleantry time of the last try to remove the worker (0: unchanged).
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t update_node_mess(mem_t *s, nodeinfo_t *node, const char *route, int remove, apr_time_t lastcleantry);
+
+/**
+ * hash of the domain as stored in nodehot_t
+ * @param domain the domain (NULL or empty: no domain).
+ * @return the hash, never 0 for a domain, 0 without domain.
+ */
+unsigned int hash_domain_node(const char *domain);
+
 /**
  * read a node record from the shared table
  * @param pointer to the shared table.
@@ -116,6 +158,17 @@ apr_status_t insert_update_node(mem_t *s, nodeinfo_t *node, int *id);
  */
 nodeinfo_t * read_node(mem_t *s, nodeinfo_t *node);
 
+/**
+ * read a consistent copy of a node record without locking (seqlock)
+ * @param pointer to the shared table.
+ * @param ids ident of the node to read.
+ * @param node address to return the node in the shared table.
+ * @param mess where to copy the node configuration.
+ * @param generation where to copy the generation of the slot.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t read_node_mess(mem_t *s, int ids, nodeinfo_t **node, nodemess_t *mess, apr_uint32_t *generation);
+
 /**
  * get a node record from the shared table
  * @param pointer to the shared table.
@@ -124,6 +177,15 @@ nodeinfo_t * read_node(mem_t *s, nodeinfo_t *node);
  */
 apr_status_t get_node(mem_t *s, nodeinfo_t **node, int ids);
 
+/**
+ * get the hot part of a node (without locking)
+ * @param pointer to the shared table.
+ * @param hot address of the hot part in the shared table.
+ * @param ids ident of the node.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t get_node_hot(mem_t *s, nodehot_t **hot, int ids);
+
 /**
  * remove(free) a node record from the shared table
  * @param pointer to the shared table.
@@ -229,6 +291,11 @@ int (*remove_node)(nodeinfo_t *node);
  * Find the node using the JVMRoute information
  */
 apr_status_t (*find_node)(nodeinfo_t **node, const char *route);
+/*
+ * Change the node in place, the readers without lock never see a half
+ * written one: remove 1 marks it removed, a lastcleantry not 0 is stored.
+ */
+apr_status_t (*update_node_mess)(nodeinfo_t *node, int remove, apr_time_t lastcleantry);
 /*
  * Remove the virtual hosts and contexts corresponding the node.
  */
@@ -244,5 +311,95 @@ apr_status_t (*lock_nodes)(void);
  */
 apr_status_t (*unlock_nodes)(void);
 
+/*
+ * read the version of the nodes table (each update of the nodes, hosts
+ * or contexts changes it).
+ */
+unsigned int (*get_version_node)(void);
+
+/**
+ * read a consistent copy of the node configuration without locking.
+ * @param ids ident of the node to read.
+ * @param node address of pointer to return the node.
+ * @param mess where to copy the nodemess_t of the node.
+ * @param generation where to copy the generation of the slot, a worker
+ *        created for another generation doesn't correspond to the node.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t (*read_node_mess)(int ids, nodeinfo_t **node, nodemess_t *mess, apr_uint32_t *generation);
+
+/**
+ * the hot part of the node corresponding to the ident.
+ * @param ids ident of the node.
+ * @param hot address of pointer to return the hot part.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t (*read_node_hot)(int ids, nodehot_t **hot);
+
+/**
+ * take or renew the lease of the cluster-wide maintenance (health probes
+ * and cleaning of the shared tables), only one child holds it.
+ * @param lease duration of the lease in seconds.
+ * @return 1 if the calling child holds the lease, 0 otherwise.
+ */
+int (*take_maintenance_lease)(int lease);
+
+/*
+ * give back the maintenance lease (the child is exiting).
+ */
+void (*release_maintenance_lease)(void);
+
+/**
+ * tell the requests waiting for a worker (in all the children) that
+ * a node came back or changed its load.
+ */
+void (*signal_capacity)(void);
+
+/**
+ * read the capacity generation.
+ * @return the generation, changed by signal_capacity().
+ */
+apr_uint32_t (*get_capacity_generation)(void);
+
+/**
+ * account a request starting to wait for a free worker.
+ */
+void (*wait_begin)(void);
+
+/**
+ * account the end of a wait.
+ * @param waited time spent waiting.
+ * @param timedout 1 if no worker was found.
+ */
+void (*wait_end)(apr_interval_time_t waited, int timedout);
+
+/**
+ * read the generation of the tables (seqlock of lock_nodes()/unlock_nodes()).
+ * It only covers the writers holding the nodes lock: the tables must not
+ * be changed without it.
+ * @return the generation, odd while the tables are being changed: a copy
+ *         made without the lock is consistent if the generation was even
+ *         and is the same after the copy.
+ */
+apr_uint32_t (*get_tables_generation)(void);
+
+/*
+ * lock the nodes table without changing the tables: the generation stays
+ * even, for the worker stats in the node slots and the locked reads.
+ */
+apr_status_t (*lock_nodes_stats)(void);
+
+/*
+ * unlock the nodes table locked by lock_nodes_stats()
+ */
+apr_status_t (*unlock_nodes_stats)(void);
+
+/**
+ * hash of a domain like the one of nodehot_t.
+ * @param domain the domain (NULL: no domain).
+ * @return the hash (0: no domain), equal hashes must still compare the domains.
+ */
+unsigned int (*hash_domain)(const char *domain);
+
 };
 #endif /*NODE_H*/
@@ -44,11 +44,27 @@
 #include "apr_pools.h"
 #include "apr_shm.h"
 
+#if APR_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+/* robust process-shared mutexes are available (ROBUST_SLOTMEM) */
+#if APR_HAS_THREADS && defined(_POSIX_THREAD_PROCESS_SHARED) && defined(_POSIX_THREAD_ROBUST_PRIO_INHERIT)
+#define HAVE_ROBUST_SLOTMEM 1
+#else
+#define HAVE_ROBUST_SLOTMEM 0
+#endif
+
 #define SLOTMEM_STORAGE "mod_cluster_slotmem"
 
 #define ATTACH_SLOTMEM 0 /* Attach to existing slotmem */
 #define CREATE_SLOTMEM 1 /* create a not persistent slotmem */
 #define CREPER_SLOTMEM 2 /* create a persisitent slotmem */
+#define INDEX_SLOTMEM  4 /* create a slotmem with a hash index of the slots (see ap_slotmem_index_do) */
+#define ROBUST_SLOTMEM 8 /* lock with a robust process-shared mutex in the slotmem instead of the lock file */
+
+/* ap_slotmem_lock(): the lock is held but its previous owner died holding it */
+#define SLOTMEM_OWNERDEAD (APR_OS_START_USERERR + 1)
 
 typedef struct ap_slotmem ap_slotmem_t; 
 
@@ -118,7 +134,8 @@ apr_status_t (* ap_slotmem_alloc)(ap_slotmem_t *s, int *item_id, void**mem);
  * @param s ap_slotmem_t to use.
  * @param item_id the id of the slot in the slotmem.
  * @param mem pointer to the slot
- * @return APR_SUCCESS if all went well
+ * @return APR_SUCCESS if all went well, SLOTMEM_OWNERDEAD if the slot was freed
+ * but the index of the slotmem must be rebuilt (see ap_slotmem_lock).
  */
 apr_status_t (* ap_slotmem_free)(ap_slotmem_t *s, int item_id, void*mem); 
 /**
@@ -136,7 +153,9 @@ int (*ap_slotmem_get_used)(ap_slotmem_t *s, int *ids);
 int (*ap_slotmem_get_max_size)(ap_slotmem_t *s);
 /**
  * Lock the slotmem
- * @return APR_SUCCESS if all went well
+ * @return APR_SUCCESS if all went well, SLOTMEM_OWNERDEAD if the lock is held
+ * but its previous owner died in the middle of an update: the index has been
+ * emptied and the caller must reindex the allocated slots (ap_slotmem_do).
  */
 apr_status_t (* ap_slotmem_lock)(ap_slotmem_t *s);
 /**
@@ -144,6 +163,27 @@ apr_status_t (* ap_slotmem_lock)(ap_slotmem_t *s);
  * @return APR_SUCCESS if all went well
  */
 apr_status_t (* ap_slotmem_unlock)(ap_slotmem_t *s);
+/**
+ * call the callback on the allocated slots indexed with the key until it
+ * returns APR_SUCCESS (the callback must check the key, the index only
+ * stores its hash). Without index it is ap_slotmem_do().
+ * @param s ap_slotmem_t to use.
+ * @param key the key used in ap_slotmem_index_add().
+ * @param funct callback function to call for each element.
+ * @param data parameter for the callback function.
+ * @param pool is pool used to create scoreboard
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t (* ap_slotmem_index_do)(ap_slotmem_t *s, const char *key, mc_slotmem_callback_fn_t *func, void *data, apr_pool_t *pool);
+/**
+ * index an allocated slot with key (the slotmem must be locked),
+ * ap_slotmem_free() removes the slot from the index.
+ * @param s ap_slotmem_t to use.
+ * @param key the key of the slot.
+ * @param item_id the id of the slot in the slotmem.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t (* ap_slotmem_index_add)(ap_slotmem_t *s, const char *key, int item_id);
 };
 
 typedef struct slotmem_storage_method slotmem_storage_method;
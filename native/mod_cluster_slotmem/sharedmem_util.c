@@ -34,10 +34,13 @@
 #include "apr_strings.h"
 #include "apr_pools.h"
 #include "apr_shm.h"
+#include "apr_mmap.h"
+#include "apr_hash.h"
 
 #include "slotmem.h"
 
 #include "httpd.h"
+#include "http_log.h"
 #ifdef AP_NEED_SET_MUTEX_PERMS
 #include "unixd.h"
 #endif
@@ -45,6 +48,13 @@
 #if APR_HAVE_UNISTD_H
 #include <unistd.h>         /* for getpid() */
 #endif
+#include <stdlib.h>         /* for malloc() */
+#include <string.h>         /* for strdup() */
+
+#if HAVE_ROBUST_SLOTMEM
+#include <pthread.h>
+#include <errno.h>
+#endif
 
 #if HAVE_SYS_SEM_H
 #include <sys/shm.h>
@@ -61,26 +71,84 @@ struct sharedslotdesc {
     apr_size_t item_size;
     int item_num;
     unsigned int version; /* integer updated each time we make a change through the API */
+    int index_size; /* number of entries in the hash index (0: no index) */
+};
+
+/* the slots start on a cache line boundary */
+#define SLOTMEM_CACHELINE 64
+
+#if HAVE_ROBUST_SLOTMEM
+/* Lock at the end of the segment (after the index) with ROBUST_SLOTMEM */
+struct slotlock {
+    pthread_mutex_t mutex;
+    pid_t pid; /* parent process that initialised it */
+};
+#define LOCK_BYTES APR_ALIGN(sizeof(struct slotlock), SLOTMEM_CACHELINE)
+#else
+#define LOCK_BYTES 0
+#endif
+
+/* Entry of the hash index (open addressing, linear probing) */
+struct slotindex {
+    unsigned int hash;
+    int id; /* id of the slot, 0 if the entry is empty */
 };
 
 struct ap_slotmem {
     char *name;
     apr_shm_t *shm;
+    apr_mmap_t *mm; /* persistent slotmem: mapping of the file instead of shm */
+    apr_file_t *file;
     int *ident; /* integer table to process a fast alloc/free */
     unsigned int *version; /* address of version */
     void *base;
     apr_size_t size;
     int num;
+    struct slotindex *index; /* hash index after the slots (NULL if none) */
+    unsigned int *hashes; /* hash of the key of each slot in the index */
+    int index_size; /* power of 2 */
     apr_pool_t *globalpool;
     apr_file_t *global_lock; /* file used for the locks */
+#if HAVE_ROBUST_SLOTMEM
+    struct slotlock *lock; /* robust mutex used instead of global_lock (NULL if none) */
+#endif
     struct ap_slotmem *next;
 };
 
+/*
+ * Content of a slotmem saved when the segments are destroyed (graceful
+ * restart) or found with another size: the new segment, maybe resized by
+ * Maxnode and friends, gets the slots back with the same ids.
+ */
+struct slotmem_image {
+    char *name;
+    struct sharedslotdesc desc;
+    int *ident; /* malloc'ed: item_num + 1 idents followed by the slots */
+    char *base;
+    struct slotmem_image *next;
+};
+
 /* global pool and list of slotmem we are handling */
 static struct ap_slotmem *globallistmem = NULL;
+static struct slotmem_image *globallistimage = NULL;
 static apr_pool_t *globalpool = NULL;
 static apr_thread_mutex_t *globalmutex_lock = NULL;
 
+/* Size of the hash index for item_num slots: power of 2 and at most half full */
+static int index_size_slotmem(int item_num)
+{
+    int size = 2;
+    while (size < item_num * 2)
+        size = size * 2;
+    return size;
+}
+static apr_size_t index_bytes_slotmem(int index_size, int item_num)
+{
+    if (!index_size)
+        return 0;
+    return APR_ALIGN_DEFAULT(sizeof(struct slotindex) * index_size + sizeof(unsigned int) * (item_num + 1));
+}
+
 static apr_status_t unixd_set_shm_perms(const char *fname)
 {
 #ifdef AP_NEED_SET_MUTEX_PERMS
@@ -131,63 +199,236 @@ static const char *store_filename(apr_pool_t *pool, const char *slotmemname)
     storename = apr_pstrcat(pool, slotmemname , ".slotmem", NULL); 
     return storename;
 }
-static void store_slotmem(ap_slotmem_t *slotmem)
+/*
+ * Size of the idents table, padded so that the slots start on a cache line
+ * (the shared memory itself is page aligned).
+ */
+static apr_size_t ident_bytes_slotmem(int item_num)
+{
+    apr_size_t dsize = APR_ALIGN_DEFAULT(sizeof(struct sharedslotdesc));
+    return APR_ALIGN(dsize + sizeof(int) * (item_num + 1), SLOTMEM_CACHELINE) - dsize;
+}
+
+/* Size of the segment described by desc, without the lock */
+static apr_size_t segment_bytes_slotmem(struct sharedslotdesc *desc)
 {
-    apr_file_t *fp;
-    apr_status_t rv;
-    apr_size_t nbytes;
-    const char *storename;
+    return APR_ALIGN_DEFAULT(sizeof(struct sharedslotdesc)) + ident_bytes_slotmem(desc->item_num) +
+           desc->item_size * desc->item_num + index_bytes_slotmem(desc->index_size, desc->item_num);
+}
 
-    storename = store_filename(slotmem->globalpool, slotmem->name);
+/*
+ * Save the desc, idents and slots starting at ptr (a segment or a
+ * persisted file read in memory) for the next ap_slotmem_create().
+ */
+static void image_slotmem(const char *name, char *ptr)
+{
+    struct slotmem_image *image;
+    apr_size_t dsize = APR_ALIGN_DEFAULT(sizeof(struct sharedslotdesc));
+    apr_size_t isize;
 
-    rv = apr_file_open(&fp, storename,  APR_CREATE | APR_READ | APR_WRITE, APR_OS_DEFAULT, slotmem->globalpool);
-    if (APR_STATUS_IS_EEXIST(rv)) {
-        apr_file_remove(storename, slotmem->globalpool);
-        rv = apr_file_open(&fp, storename,  APR_CREATE | APR_READ | APR_WRITE, APR_OS_DEFAULT, slotmem->globalpool);
+    image = malloc(sizeof(struct slotmem_image));
+    if (image == NULL)
+        return;
+    memcpy(&image->desc, ptr, sizeof(struct sharedslotdesc));
+    isize = sizeof(int) * (image->desc.item_num + 1);
+    image->ident = malloc(isize + image->desc.item_size * image->desc.item_num);
+    image->name = strdup(name);
+    if (image->ident == NULL || image->name == NULL) {
+        free(image->ident);
+        free(image->name);
+        free(image);
+        return;
     }
-    if (rv != APR_SUCCESS) {
+    ptr = ptr + dsize;
+    memcpy(image->ident, ptr, isize);
+    image->base = (char *) image->ident + isize;
+    memcpy(image->base, ptr + ident_bytes_slotmem(image->desc.item_num), image->desc.item_size * image->desc.item_num);
+    image->next = globallistimage;
+    globallistimage = image;
+}
+static void free_image_slotmem(struct slotmem_image *image)
+{
+    free(image->ident);
+    free(image->name);
+    free(image);
+}
+/* remove the image of the slotmem name from the list */
+static struct slotmem_image *take_image_slotmem(const char *name)
+{
+    struct slotmem_image **prev, *image;
+    for (prev = &globallistimage; (image = *prev) != NULL; prev = &image->next) {
+        if (strcmp(image->name, name) == 0) {
+            *prev = image->next;
+            return image;
+        }
+    }
+    return NULL;
+}
+/*
+ * Copy the allocated slots of the image into the new (empty) slotmem and
+ * rebuild its free list. The slots keep their ids: when the slotmem
+ * shrinks the ones above item_num are lost. The hash indexes are rebuilt
+ * by the callers like for a restored slotmem.
+ */
+static void migrate_slotmem(ap_slotmem_t *mem, struct slotmem_image *image)
+{
+    int i, prev, num;
+    int *ident = mem->ident;
+
+    if (image->desc.item_size != mem->size)
+        return; /* the layout of the slots has changed */
+    num = image->desc.item_num < mem->num ? image->desc.item_num : mem->num;
+    for (i = 1; i <= num; i++) {
+        if (image->ident[i] != 0)
+            continue;
+        memcpy((char *) mem->base + mem->size * (i - 1), image->base + image->desc.item_size * (i - 1), mem->size);
+        ident[i] = 0;
+    }
+    for (prev = 0, i = 1; i <= mem->num; i++) {
+        if (ident[i] == 0)
+            continue;
+        ident[prev] = i;
+        prev = i;
+    }
+    ident[prev] = mem->num + 1;
+    *mem->version = image->desc.version + 1;
+}
+
+/*
+ * Read a persisted file that doesn't match the slotmem (another size or
+ * an older layout) and keep it as an image to migrate. The layouts are
+ * the segment itself, the desc + idents + slots written at the cleanup
+ * by previous versions and the idents + slots written before.
+ */
+static void image_file_slotmem(const char *name, apr_file_t *fp, apr_off_t size,
+                               apr_size_t item_size, int item_num, apr_pool_t *pool)
+{
+    struct sharedslotdesc desc;
+    apr_size_t dsize = APR_ALIGN_DEFAULT(sizeof(desc));
+    apr_size_t nbytes = (apr_size_t) size;
+    apr_off_t off = 0;
+    char *ptr;
+
+    if (size <= 0)
+        return;
+    ptr = apr_palloc(pool, dsize + nbytes);
+    apr_file_seek(fp, APR_SET, &off);
+    if (apr_file_read_full(fp, ptr + dsize, nbytes, NULL) != APR_SUCCESS)
+        return;
+    if (size == (apr_off_t) (item_size * item_num + sizeof(int) * (item_num + 1))) {
+        /*
+         * no desc: the idents and the slots of the same table (nothing else
+         * was restored), the slots start aligned after the idents and the
+         * file misses the padding of the idents at the end.
+         */
+        apr_size_t isize = sizeof(int) * (item_num + 1);
+        apr_size_t tsize = APR_ALIGN_DEFAULT(isize);
+        char *old = ptr + dsize;
+        if (nbytes < tsize)
+            return;
+        ptr = apr_pcalloc(pool, dsize + ident_bytes_slotmem(item_num) + item_size * item_num);
+        memset(&desc, 0, sizeof(desc));
+        desc.item_size = item_size;
+        desc.item_num = item_num;
+        memcpy(ptr, &desc, sizeof(desc));
+        memcpy(ptr + dsize, old, isize);
+        memcpy(ptr + dsize + ident_bytes_slotmem(item_num), old + tsize, nbytes - tsize);
+        image_slotmem(name, ptr);
         return;
     }
-    nbytes = slotmem->size * slotmem->num + sizeof(int) * (slotmem->num + 1);
-    apr_file_write(fp, slotmem->ident, &nbytes);
-    apr_file_close(fp);
+    ptr = ptr + dsize;
+    memcpy(&desc, ptr, sizeof(desc));
+    if (desc.item_num <= 0)
+        return;
+    nbytes = dsize + ident_bytes_slotmem(desc.item_num) + desc.item_size * desc.item_num;
+    if (size == (apr_off_t) nbytes || size == (apr_off_t) segment_bytes_slotmem(&desc) ||
+        size == (apr_off_t) (segment_bytes_slotmem(&desc) + LOCK_BYTES))
+        image_slotmem(name, ptr);
 }
-static void restore_slotmem(void *ptr, const char *name, apr_size_t item_size, int item_num, apr_pool_t *pool)
+
+/*
+ * Persistent slotmem: the segment is a shared mapping of the file
+ * $name.slotmem, each change goes to the page cache and the kernel writes
+ * it back, so the tables survive a crash of httpd and a restart maps them
+ * again without reading or writing the whole table. Another layout is
+ * rebuilt in a new file renamed over the old one: the children of the
+ * previous generation keep their mapping of the old file.
+ * @param created set to 1 when the file is new and must be initialised.
+ */
+static apr_status_t map_slotmem(ap_slotmem_t *res, const char *fname, struct sharedslotdesc *want,
+                                apr_size_t nbytes, int *created, apr_pool_t *pool)
 {
-    const char *storename;
+    const char *storename = store_filename(pool, fname);
+    const char *newname;
     apr_file_t *fp;
-    apr_size_t nbytes;
+    apr_finfo_t fi;
     apr_status_t rv;
 
-    item_size = APR_ALIGN_DEFAULT(item_size);
-    nbytes = item_size * item_num + sizeof(int) * (item_num + 1);
-    storename = store_filename(pool, name);
-    rv = apr_file_open(&fp, storename,  APR_READ | APR_WRITE, APR_OS_DEFAULT, pool);
+    rv = apr_file_open(&fp, storename, APR_READ | APR_WRITE, APR_OS_DEFAULT, globalpool);
     if (rv == APR_SUCCESS) {
-        apr_finfo_t fi;
         if (apr_file_info_get(&fi, APR_FINFO_SIZE, fp) == APR_SUCCESS) {
-            if (fi.size == nbytes) {
-                apr_file_read(fp, ptr, &nbytes);
-            }
-            else {
-                apr_file_close(fp);
-                apr_file_remove(storename, pool);
-                return;
+            struct sharedslotdesc desc;
+            if (fi.size == (apr_off_t) nbytes &&
+                apr_file_read_full(fp, &desc, sizeof(desc), NULL) == APR_SUCCESS &&
+                desc.item_size == want->item_size && desc.item_num == want->item_num && desc.index_size == want->index_size) {
+                rv = apr_mmap_create(&res->mm, fp, 0, nbytes, APR_MMAP_READ | APR_MMAP_WRITE, globalpool);
+                if (rv == APR_SUCCESS) {
+                    res->file = fp;
+                    *created = 0;
+                    return APR_SUCCESS;
+                }
             }
+            image_file_slotmem(fname, fp, fi.size, want->item_size, want->item_num, pool);
+        }
+        apr_file_close(fp);
+    }
+
+    newname = apr_pstrcat(pool, storename, ".new", NULL);
+    rv = apr_file_open(&fp, newname, APR_READ | APR_WRITE | APR_CREATE | APR_TRUNCATE, APR_OS_DEFAULT, globalpool);
+    if (rv != APR_SUCCESS)
+        return rv;
+    rv = apr_file_trunc(fp, nbytes);
+    if (rv == APR_SUCCESS)
+        rv = apr_mmap_create(&res->mm, fp, 0, nbytes, APR_MMAP_READ | APR_MMAP_WRITE, globalpool);
+    if (rv == APR_SUCCESS)
+        rv = apr_file_rename(newname, storename, pool);
+    if (rv != APR_SUCCESS) {
+        if (res->mm) {
+            apr_mmap_delete(res->mm);
+            res->mm = NULL;
         }
         apr_file_close(fp);
+        apr_file_remove(newname, pool);
+        return rv;
     }
+    res->file = fp;
+    *created = 1;
+    return APR_SUCCESS;
 }
 
 static apr_status_t cleanup_slotmem(void *param)
 {
     ap_slotmem_t **mem = param;
 
+    /* the images of the previous restart weren't used */
+    while (globallistimage) {
+        struct slotmem_image *image = globallistimage;
+        globallistimage = image->next;
+        free_image_slotmem(image);
+    }
     if (*mem) {
         ap_slotmem_t *next = *mem;
         while (next) {
-            store_slotmem(next);
-            apr_shm_destroy(next->shm);
+            if (next->mm) {
+                /* the file is up to date: the next generation maps it again */
+                apr_mmap_delete(next->mm);
+                apr_file_close(next->file);
+            }
+            else {
+                /* keep the content for the segments of the next generation */
+                image_slotmem(next->name, apr_shm_baseaddr_get(next->shm));
+                apr_shm_destroy(next->shm);
+            }
             /* XXX: remove the lock file ? */
             if (next->global_lock) {
                 apr_file_close(next->global_lock);
@@ -195,13 +436,15 @@ static apr_status_t cleanup_slotmem(void *param)
             }
             next = next->next;
         }
+        /* recreate the segments (maybe with new sizes) after a graceful restart */
+        *mem = NULL;
     }
     return APR_SUCCESS;
 }
 
 static apr_status_t ap_slotmem_do(ap_slotmem_t *mem, mc_slotmem_callback_fn_t *func, void *data, apr_pool_t *pool)
 {
-    int i, j, isfree, *ident;
+    int i, *ident;
     char *ptr;
     apr_status_t rv;
 
@@ -209,31 +452,167 @@ static apr_status_t ap_slotmem_do(ap_slotmem_t *mem, mc_slotmem_callback_fn_t *f
         return APR_ENOSHMAVAIL;
     }
 
-    /* performs the func only on allocated slots! */
+    /* performs the func only on allocated slots! (ident[i] is 0 for them) */
     ptr = mem->base;
-    for (i = 1; i < mem->num+1; i++) {
-        ident = mem->ident;
-        isfree = 0;
-        for (j=0; j<mem->num+1; j++) {
-            if (ident[j] == i) {
-                isfree = 1;
-                break;
-            }
+    ident = mem->ident;
+    for (i = 1; i < mem->num+1; i++, ptr = ptr + mem->size) {
+        if (ident[i] != 0)
+            continue;
+        rv = func((void *)ptr, data, i, pool);
+        if (rv == APR_SUCCESS) {
+            return(rv);
         }
-        if (!isfree) {
-            rv = func((void *)ptr, data, i, pool);
-            if (rv == APR_SUCCESS) {
-                return(rv);
-            }
+    }
+    return APR_NOTFOUND;
+}
+/*
+ * Hash index of the slots: the entries are (hash, id) in a table of
+ * index_size entries using linear probing. The removal shifts back the
+ * following entries so there aren't any tombstones (see Knuth 6.4 R).
+ */
+static unsigned int hash_slotmem(const char *key)
+{
+    apr_ssize_t len = APR_HASH_KEY_STRING;
+    return apr_hashfunc_default(key, &len);
+}
+static void index_remove_slotmem(ap_slotmem_t *mem, int item_id)
+{
+    int i, j, k;
+    unsigned int mask = mem->index_size - 1;
+    struct slotindex *index = mem->index;
+
+    /* find the entry of the slot */
+    i = mem->hashes[item_id] & mask;
+    while (index[i].id != item_id) {
+        if (index[i].id == 0)
+            return; /* not indexed */
+        i = (i + 1) & mask;
+    }
+    /* shift back the entries that can't be found once i is empty */
+    j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (index[j].id == 0)
+            break;
+        k = index[j].hash & mask;
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+            continue; /* still reachable from its home */
+        index[i] = index[j];
+        i = j;
+    }
+    index[i].id = 0;
+}
+static apr_status_t ap_slotmem_index_add(ap_slotmem_t *mem, const char *key, int item_id)
+{
+    int i;
+    unsigned int hash, mask;
+
+    if (!mem) {
+        return APR_ENOSHMAVAIL;
+    }
+    if (item_id <= 0 || item_id > mem->num) {
+        return APR_EINVAL;
+    }
+    if (!mem->index) {
+        return APR_SUCCESS; /* nothing to maintain */
+    }
+    hash = hash_slotmem(key);
+    mask = mem->index_size - 1;
+    /* already indexed (restored or attached slotmem) or the key has changed */
+    for (i = mem->hashes[item_id] & mask; mem->index[i].id != 0; i = (i + 1) & mask) {
+        if (mem->index[i].id == item_id) {
+            if (mem->hashes[item_id] == hash)
+                return APR_SUCCESS;
+            index_remove_slotmem(mem, item_id);
+            break;
+        }
+    }
+    for (i = hash & mask; mem->index[i].id != 0; i = (i + 1) & mask)
+        ;
+    mem->hashes[item_id] = hash;
+    mem->index[i].hash = hash;
+    mem->index[i].id = item_id;
+    return APR_SUCCESS;
+}
+static apr_status_t ap_slotmem_index_do(ap_slotmem_t *mem, const char *key, mc_slotmem_callback_fn_t *func, void *data, apr_pool_t *pool)
+{
+    int i, n;
+    unsigned int hash, mask;
+    apr_status_t rv;
+
+    if (!mem) {
+        return APR_ENOSHMAVAIL;
+    }
+    if (!mem->index) {
+        return ap_slotmem_do(mem, func, data, pool);
+    }
+    hash = hash_slotmem(key);
+    mask = mem->index_size - 1;
+    /* n prevents looping when a writer changes the index under us */
+    for (i = hash & mask, n = 0; n < mem->index_size; i = (i + 1) & mask, n++) {
+        int id = mem->index[i].id;
+        if (id == 0)
+            break;
+        if (mem->index[i].hash != hash || id > mem->num || mem->ident[id] != 0)
+            continue;
+        rv = func((char *) mem->base + mem->size * (id - 1), data, id, pool);
+        if (rv == APR_SUCCESS) {
+            return(rv);
         }
-        ptr = ptr + mem->size;
     }
     return APR_NOTFOUND;
 }
-/* Lock the file lock (between processes) and then the mutex */
+#if HAVE_ROBUST_SLOTMEM
+/* Initialise the robust process-shared mutex of a segment */
+static apr_status_t init_lock_slotmem(struct slotlock *lock)
+{
+    pthread_mutexattr_t attr;
+    int rc;
+
+    rc = pthread_mutexattr_init(&attr);
+    if (rc)
+        return APR_FROM_OS_ERROR(rc);
+    rc = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (!rc)
+        rc = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (!rc)
+        rc = pthread_mutex_init(&lock->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (rc)
+        return APR_FROM_OS_ERROR(rc);
+    lock->pid = getpid();
+    return APR_SUCCESS;
+}
+#endif
+
+/*
+ * Lock the file lock (between processes) and then the mutex or,
+ * with ROBUST_SLOTMEM, the mutex of the segment (between processes and threads).
+ */
 static apr_status_t ap_slotmem_lock(ap_slotmem_t *s)
 {
     apr_status_t rv;
+#if HAVE_ROBUST_SLOTMEM
+    if (s->lock) {
+        int rc = pthread_mutex_lock(&s->lock->mutex);
+        if (rc == EOWNERDEAD) {
+            /* the owner died holding it: the slots and the index may be half-written */
+            rc = pthread_mutex_consistent(&s->lock->mutex);
+            if (rc) {
+                pthread_mutex_unlock(&s->lock->mutex);
+                return APR_FROM_OS_ERROR(rc);
+            }
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL,
+                         "ap_slotmem_lock: %s: the owner of the lock died during an update", s->name);
+            if (s->index) {
+                memset(s->index, 0, sizeof(struct slotindex) * s->index_size);
+                memset(s->hashes, 0, sizeof(unsigned int) * (s->num + 1));
+            }
+            return SLOTMEM_OWNERDEAD;
+        }
+        return APR_FROM_OS_ERROR(rc);
+    }
+#endif
     rv = apr_file_lock(s->global_lock, APR_FLOCK_EXCLUSIVE);
     if (rv != APR_SUCCESS)
         return rv;
@@ -244,6 +623,10 @@ static apr_status_t ap_slotmem_lock(ap_slotmem_t *s)
 }
 static apr_status_t ap_slotmem_unlock(ap_slotmem_t *s)
 {
+#if HAVE_ROBUST_SLOTMEM
+    if (s->lock)
+        return APR_FROM_OS_ERROR(pthread_mutex_unlock(&s->lock->mutex));
+#endif
     apr_thread_mutex_unlock(globalmutex_lock);
     return(apr_file_unlock(s->global_lock));
 }
@@ -260,11 +643,14 @@ static apr_status_t ap_slotmem_create(ap_slotmem_t **new, const char *name, apr_
     const char *filename;
     apr_size_t nbytes;
     int i, *ident;
+    int created = 0;
     apr_size_t dsize = APR_ALIGN_DEFAULT(sizeof(desc));
-    apr_size_t tsize = APR_ALIGN_DEFAULT(sizeof(int) * (item_num + 1));
+    apr_size_t tsize = ident_bytes_slotmem(item_num);
+    int index_size = (persist & INDEX_SLOTMEM) ? index_size_slotmem(item_num) : 0;
+    apr_size_t lsize = (persist & ROBUST_SLOTMEM) ? LOCK_BYTES : 0;
 
     item_size = APR_ALIGN_DEFAULT(item_size);
-    nbytes = item_size * item_num + tsize + dsize;
+    nbytes = item_size * item_num + tsize + dsize + index_bytes_slotmem(index_size, item_num) + lsize;
     if (globalpool == NULL)
         return APR_ENOSHMAVAIL;
     if (name) {
@@ -301,33 +687,58 @@ static apr_status_t ap_slotmem_create(ap_slotmem_t **new, const char *name, apr_
     /* lock for creation */
     ap_slotmem_lock(res);
 
+    desc.item_size = item_size;
+    desc.item_num = item_num;
+    desc.version = 0;
+    desc.index_size = index_size;
+    if (persist & CREPER_SLOTMEM) {
+        rv = map_slotmem(res, fname, &desc, nbytes, &created, pool);
+        if (rv != APR_SUCCESS) {
+            ap_slotmem_unlock(res);
+            return rv;
+        }
+        ptr = res->mm->mm;
+        new_desc = (struct sharedslotdesc *) ptr;
+        if (created) {
+            memcpy(ptr, &desc, sizeof(desc));
+            ptr = ptr + dsize;
+            ident = (int *) ptr;
+            for (i=0; i<item_num+1; i++) {
+                ident[i] = i + 1;
+            }
+        }
+        else
+            ptr = ptr + dsize;
+        rv = APR_SUCCESS;
+    }
     /* first try to attach to existing shared memory */
-    if (name) {
+    else if (name) {
         rv = apr_shm_attach(&res->shm, fname, globalpool);
     }
     else {
         rv = APR_EINVAL;
     }
-    if (rv == APR_SUCCESS) {
-        /* check size */
-        if (apr_shm_size_get(res->shm) != nbytes) {
-            apr_shm_detach(res->shm);
-            res->shm = NULL;
-            ap_slotmem_unlock(res);
-            return APR_EINVAL;
-        }
+    if (res->mm) {
+        /* mapped file, done above */
+    }
+    else if (rv == APR_SUCCESS) {
         ptr = apr_shm_baseaddr_get(res->shm);
         memcpy(&desc, ptr, sizeof(desc));
-        if (desc.item_size != item_size || desc.item_num != item_num) {
+        if (apr_shm_size_get(res->shm) != nbytes ||
+            desc.item_size != item_size || desc.item_num != item_num || desc.index_size != index_size) {
+            /* resized: keep the content and replace the segment */
+            if (desc.item_num > 0 && (apr_shm_size_get(res->shm) == segment_bytes_slotmem(&desc) ||
+                apr_shm_size_get(res->shm) == segment_bytes_slotmem(&desc) + LOCK_BYTES))
+                image_slotmem(fname, ptr);
             apr_shm_detach(res->shm);
             res->shm = NULL;
-            ap_slotmem_unlock(res);
-            return APR_EINVAL;
         }
-        new_desc = (struct sharedslotdesc *) ptr;
-        ptr = ptr +  dsize;
+        else {
+            new_desc = (struct sharedslotdesc *) ptr;
+            ptr = ptr +  dsize;
+        }
     }
-    else  {
+    if (res->mm == NULL && res->shm == NULL) {
         if (name) {
             int try = 0;
             rv = APR_EEXIST;
@@ -355,8 +766,6 @@ static apr_status_t ap_slotmem_create(ap_slotmem_t **new, const char *name, apr_
             unixd_set_shm_perms(fname);
         }
         ptr = apr_shm_baseaddr_get(res->shm);
-        desc.item_size = item_size;
-        desc.item_num = item_num;
         new_desc = (struct sharedslotdesc *) ptr;
         memcpy(ptr, &desc, sizeof(desc));
         ptr = ptr +  dsize;
@@ -365,11 +774,10 @@ static apr_status_t ap_slotmem_create(ap_slotmem_t **new, const char *name, apr_
         for (i=0; i<item_num+1; i++) {
             ident[i] = i + 1;
         }
-        /* clean the slots table */
-        memset(ptr + sizeof(int) * (item_num + 1), 0, item_size * item_num);
-        /* try to restore the _whole_ stuff from a persisted location */
-        if (persist & CREPER_SLOTMEM)
-            restore_slotmem(ptr, fname, item_size, item_num, pool);
+        /* clean the slots table, the index and the lock */
+        memset(ptr + sizeof(int) * (item_num + 1), 0, tsize - sizeof(int) * (item_num + 1) + item_size * item_num +
+               index_bytes_slotmem(index_size, item_num) + lsize);
+        created = 1;
     }
 
     /* For the chained slotmem stuff */
@@ -379,8 +787,21 @@ static apr_status_t ap_slotmem_create(ap_slotmem_t **new, const char *name, apr_
     res->size = item_size;
     res->num = item_num;
     res->version = &(new_desc->version);
+    if (index_size) {
+        res->index = (struct slotindex *) (ptr + tsize + item_size * item_num);
+        res->hashes = (unsigned int *) (res->index + index_size);
+        res->index_size = index_size;
+    }
     res->globalpool = globalpool;
     res->next = NULL;
+    if (created) {
+        /* get the slots of the previous segment or of the persisted file back */
+        struct slotmem_image *image = take_image_slotmem(fname);
+        if (image) {
+            migrate_slotmem(res, image);
+            free_image_slotmem(image);
+        }
+    }
     if (globallistmem==NULL) {
         globallistmem = res;
     }
@@ -388,6 +809,23 @@ static apr_status_t ap_slotmem_create(ap_slotmem_t **new, const char *name, apr_
         next->next = res;
     }
 
+#if HAVE_ROBUST_SLOTMEM
+    if (lsize) {
+        /* a new segment or one left by another instance: a graceful restart keeps the one in use */
+        struct slotlock *slock = (struct slotlock *) ((char *) new_desc + nbytes - lsize);
+        if (!created && slock->pid == getpid())
+            rv = APR_SUCCESS;
+        else
+            rv = init_lock_slotmem(slock);
+        ap_slotmem_unlock(res);
+        /* the file lock is still used if the mutex can't be created */
+        if (rv == APR_SUCCESS)
+            res->lock = slock;
+        *new = res;
+        return APR_SUCCESS;
+    }
+#endif
+
     *new = res;
     ap_slotmem_unlock(res);
     return APR_SUCCESS;
@@ -436,7 +874,22 @@ static apr_status_t ap_slotmem_attach(ap_slotmem_t **new, const char *name, apr_
     res = (ap_slotmem_t *) apr_pcalloc(globalpool, sizeof(ap_slotmem_t));
     rv = apr_shm_attach(&res->shm, fname, globalpool);
     if (rv != APR_SUCCESS) {
-        return rv;
+        /* a persistent slotmem is a mapping of its file */
+        apr_finfo_t fi;
+        res->shm = NULL;
+        rv = apr_file_open(&res->file, store_filename(pool, fname), APR_READ | APR_WRITE, APR_OS_DEFAULT, globalpool);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        rv = apr_file_info_get(&fi, APR_FINFO_SIZE, res->file);
+        if (rv == APR_SUCCESS && fi.size < (apr_off_t) dsize)
+            rv = APR_EINVAL;
+        if (rv == APR_SUCCESS)
+            rv = apr_mmap_create(&res->mm, res->file, 0, (apr_size_t) fi.size, APR_MMAP_READ | APR_MMAP_WRITE, globalpool);
+        if (rv != APR_SUCCESS) {
+            apr_file_close(res->file);
+            return rv;
+        }
     }
     /* get the corresponding lock */
     filename = apr_pstrcat(pool, fname , ".lock", NULL);
@@ -446,10 +899,15 @@ static apr_status_t ap_slotmem_attach(ap_slotmem_t **new, const char *name, apr_
     }
 
     /* Read the description of the slotmem */
-    ptr = apr_shm_baseaddr_get(res->shm);
+    ptr = res->mm ? res->mm->mm : apr_shm_baseaddr_get(res->shm);
     memcpy(&desc, ptr, sizeof(desc));
+#if HAVE_ROBUST_SLOTMEM
+    /* the size tells whether the segment has a lock */
+    if ((res->mm ? res->mm->size : apr_shm_size_get(res->shm)) == segment_bytes_slotmem(&desc) + LOCK_BYTES)
+        res->lock = (struct slotlock *) (ptr + segment_bytes_slotmem(&desc));
+#endif
     ptr = ptr + dsize;
-    tsize = APR_ALIGN_DEFAULT(sizeof(int) * (desc.item_num + 1));
+    tsize = ident_bytes_slotmem(desc.item_num);
 
     /* For the chained slotmem stuff */
     res->name = apr_pstrdup(globalpool, fname);
@@ -457,7 +915,12 @@ static apr_status_t ap_slotmem_attach(ap_slotmem_t **new, const char *name, apr_
     res->base = ptr + tsize;
     res->size = desc.item_size;
     res->num = desc.item_num;
-    *res->version = 0;
+    res->version = &(((struct sharedslotdesc *) (ptr - dsize))->version);
+    if (desc.index_size) {
+        res->index = (struct slotindex *) ((char *) res->base + desc.item_size * desc.item_num);
+        res->hashes = (unsigned int *) (res->index + desc.index_size);
+        res->index_size = desc.index_size;
+    }
     res->globalpool = globalpool;
     res->next = NULL;
     if (globallistmem==NULL) {
@@ -476,8 +939,6 @@ static apr_status_t ap_slotmem_mem(ap_slotmem_t *score, int id, void**mem)
 {
 
     char *ptr;
-    int i;
-    int *ident;
 
     if (!score) {
         return APR_ENOSHMAVAIL;
@@ -486,12 +947,11 @@ static apr_status_t ap_slotmem_mem(ap_slotmem_t *score, int id, void**mem)
         return APR_ENOSHMAVAIL;
     }
 
-    /* Check that it is not a free slot */
-    ident = score->ident;
-    for (i=0; i<score->num+1; i++) {
-        if (ident[i] == id)
-            return APR_NOTFOUND;
-    } 
+    /* Check that it is not a free slot: ident[id] is 0 for the allocated slots
+     * and the next free slot for the free ones (ident[0] is the free list head).
+     */
+    if (score->ident[id] != 0)
+        return APR_NOTFOUND;
 
     ptr = (char *) score->base + score->size * (id - 1);
     if (!ptr) {
@@ -525,22 +985,27 @@ static apr_status_t ap_slotmem_free(ap_slotmem_t *score, int item_id, void*mem)
 {
     int ff;
     int *ident;
+    apr_status_t rv;
     if (item_id > score->num || item_id <=0) {
         return APR_EINVAL;
     } else {
-        ap_slotmem_lock(score);
+        rv = ap_slotmem_lock(score);
+        if (rv != SLOTMEM_OWNERDEAD || !score->index)
+            rv = APR_SUCCESS; /* only an emptied index is left to the caller */
         ident = score->ident;
         if (ident[item_id]) {
             ap_slotmem_unlock(score);
             (*score->version)++;
-            return APR_SUCCESS;
+            return rv;
         }
+        if (score->index)
+            index_remove_slotmem(score, item_id);
         ff = ident[0];
         ident[0] = item_id;
         ident[item_id] = ff;
         ap_slotmem_unlock(score);
         (*score->version)++;
-        return APR_SUCCESS;
+        return rv;
     }
 }
 static int ap_slotmem_get_used(ap_slotmem_t *score, int *ids)
@@ -574,7 +1039,9 @@ static const slotmem_storage_method storage = {
     &ap_slotmem_get_used,
     &ap_slotmem_get_max_size,
     &ap_slotmem_lock,
-    &ap_slotmem_unlock
+    &ap_slotmem_unlock,
+    &ap_slotmem_index_do,
+    &ap_slotmem_index_add
 };
 
 /* make the storage usuable from outside
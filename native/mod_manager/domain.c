@@ -44,6 +44,22 @@
 
 #include "mod_manager.h"
 
+/* Add a domain to the JVMRoute hash index of the table */
+static apr_status_t index_domain(void* mem, void **data, int id, apr_pool_t *pool)
+{
+    mem_t *s = (mem_t *) *data;
+    domaininfo_t *ou = (domaininfo_t *)mem;
+    s->storage->ap_slotmem_index_add(s->slotmem, ou->JVMRoute, id);
+    return APR_NOTFOUND; /* next one */
+}
+
+/* lock the table, rebuild the index emptied by a process that died holding the lock */
+static void lock_mem_domain(mem_t *s)
+{
+    if (s->storage->ap_slotmem_lock(s->slotmem) == SLOTMEM_OWNERDEAD)
+        s->storage->ap_slotmem_do(s->slotmem, index_domain, &s, s->p);
+}
+
 static mem_t * create_attach_mem_domain(char *string, int *num, int type, apr_pool_t *p, slotmem_storage_method *storage) {
     mem_t *ptr;
     const char *storename;
@@ -56,7 +72,7 @@ static mem_t * create_attach_mem_domain(char *string, int *num, int type, apr_po
     ptr->storage =  storage;
     storename = apr_pstrcat(p, string, DOMAINEXE, NULL); 
     if (type)
-        rv = ptr->storage->ap_slotmem_create(&ptr->slotmem, storename, sizeof(domaininfo_t), *num, type, p);
+        rv = ptr->storage->ap_slotmem_create(&ptr->slotmem, storename, sizeof(domaininfo_t), *num, type|INDEX_SLOTMEM, p);
     else {
         apr_size_t size = sizeof(domaininfo_t);
         rv = ptr->storage->ap_slotmem_attach(&ptr->slotmem, storename, &size, num, p);
@@ -66,6 +82,12 @@ static mem_t * create_attach_mem_domain(char *string, int *num, int type, apr_po
     }
     ptr->num = *num;
     ptr->p = p;
+    if (type) {
+        /* the index of a mapped file may be stale and a migrated table has none: (re)index the domains */
+        ptr->storage->ap_slotmem_lock(ptr->slotmem);
+        ptr->storage->ap_slotmem_do(ptr->slotmem, index_domain, &ptr, p);
+        ptr->storage->ap_slotmem_unlock(ptr->slotmem);
+    }
     return ptr;
 }
 /**
@@ -95,8 +117,8 @@ apr_status_t insert_update_domain(mem_t *s, domaininfo_t *domain)
     int ident;
 
     domain->id = 0;
-    s->storage->ap_slotmem_lock(s->slotmem);
-    rv = s->storage->ap_slotmem_do(s->slotmem, insert_update, &domain, s->p);
+    lock_mem_domain(s);
+    rv = s->storage->ap_slotmem_index_do(s->slotmem, domain->JVMRoute, insert_update, &domain, s->p);
     if (domain->id != 0 && rv == APR_SUCCESS) {
          s->storage->ap_slotmem_unlock(s->slotmem);
         return APR_SUCCESS; /* updated */
@@ -110,6 +132,7 @@ apr_status_t insert_update_domain(mem_t *s, domaininfo_t *domain)
     }
     memcpy(ou, domain, sizeof(domaininfo_t));
     ou->id = ident;
+    s->storage->ap_slotmem_index_add(s->slotmem, ou->JVMRoute, ident);
     s->storage->ap_slotmem_unlock(s->slotmem);
     ou->updatetime = apr_time_sec(apr_time_now());
 
@@ -140,7 +163,7 @@ domaininfo_t * read_domain(mem_t *s, domaininfo_t *domain)
     if (domain->id)
         rv = s->storage->ap_slotmem_mem(s->slotmem, domain->id, (void **) &ou);
     else {
-        rv = s->storage->ap_slotmem_do(s->slotmem, loc_read_domain, &ou, s->p);
+        rv = s->storage->ap_slotmem_index_do(s->slotmem, domain->JVMRoute, loc_read_domain, &ou, s->p);
     }
     if (rv == APR_SUCCESS)
         return ou;
@@ -172,10 +195,17 @@ apr_status_t remove_domain(mem_t *s, domaininfo_t *domain)
         rv = s->storage->ap_slotmem_free(s->slotmem, domain->id, domain);
     } else {
         /* XXX: for the moment January 2007 ap_slotmem_free only uses ident to remove */
-        rv = s->storage->ap_slotmem_do(s->slotmem, loc_read_domain, &ou, s->p);
+        rv = s->storage->ap_slotmem_index_do(s->slotmem, domain->JVMRoute, loc_read_domain, &ou, s->p);
         if (rv == APR_SUCCESS)
             rv = s->storage->ap_slotmem_free(s->slotmem, ou->id, domain);
     }
+    if (rv == SLOTMEM_OWNERDEAD) {
+        /* ap_slotmem_free() emptied the index */
+        lock_mem_domain(s);
+        s->storage->ap_slotmem_do(s->slotmem, index_domain, &s, s->p);
+        s->storage->ap_slotmem_unlock(s->slotmem);
+        rv = APR_SUCCESS;
+    }
     return rv;
 }
 
@@ -196,7 +226,7 @@ apr_status_t find_domain(mem_t *s, domaininfo_t **domain, const char *route, con
     strncpy(ou.balancer, balancer, sizeof(ou.balancer));
     ou.balancer[sizeof(ou.balancer) - 1] = '\0';
     *domain = &ou;
-    rv = s->storage->ap_slotmem_do(s->slotmem, loc_read_domain, domain, s->p);
+    rv = s->storage->ap_slotmem_index_do(s->slotmem, ou.JVMRoute, loc_read_domain, domain, s->p);
     return rv;
 }
 
@@ -28,6 +28,7 @@
 #include "apr_strings.h"
 #include "apr_lib.h"
 #include "apr_uuid.h"
+#include "apr_atomic.h"
 
 #define CORE_PRIVATE
 #include "httpd.h"
@@ -52,10 +53,15 @@
 #include "sessionid.h"
 #include "domain.h"
 
+#if APR_HAVE_UNISTD_H
+/* for getpid() */
+#include <unistd.h>
+#endif
+
 #define DEFMAXCONTEXT   100
 #define DEFMAXNODE      20
 #define DEFMAXHOST      20
-#define DEFMAXSESSIONID 0 /* it has performance/security impact */
+#define DEFMAXSESSIONID 0 /* it has memory/security impact */
 #define MAXMESSSIZE     1024
 
 /* Warning messages */
@@ -117,7 +123,16 @@
 
 /* Data structure for shared memory block */
 typedef struct version_data {
-    apr_uint64_t counter;
+    apr_uint32_t counter; /* apr_atomic: read without lock by each request */
+    apr_uint32_t leader; /* pid of the child holding the maintenance lease (0: none) */
+    apr_uint32_t lease;  /* end of the lease in seconds */
+    apr_uint32_t capacity;     /* bumped when a worker frees capacity while requests are waiting */
+    apr_uint32_t waiting;      /* requests waiting for a free worker in all the children */
+    apr_uint32_t maxwaiting;   /* highest number of waiting requests */
+    apr_uint32_t waits;        /* requests that had to wait */
+    apr_uint32_t waittimeouts; /* requests that waited in vain */
+    apr_uint32_t waittime;     /* total time waited in milliseconds */
+    apr_uint32_t tables;       /* generation of the tables: odd while the nodes lock is held */
 } version_data;
 
 /* mutex and lock for tables/slotmen */
@@ -125,6 +140,9 @@ static apr_thread_mutex_t *nodes_global_mutex = NULL;
 static apr_file_t *nodes_global_lock = NULL;
 static apr_thread_mutex_t *contexts_global_mutex = NULL;
 static apr_file_t *contexts_global_lock = NULL;
+/* robust mutexes used instead of the lock files (SlotLock robust) */
+static ap_slotmem_t *nodes_global_mem = NULL;
+static ap_slotmem_t *contexts_global_mem = NULL;
 
 /* counter for the version (nodes) */
 static apr_shm_t *versionipc_shm = NULL;
@@ -164,6 +182,9 @@ typedef struct mod_manager_config
     /* Should be the slotmem persisted (1) or not (0) */
     int persistent;
 
+    /* lock of the slotmem: lock file (0) or robust mutex (ROBUST_SLOTMEM) */
+    int slotlock;
+
     /* check for nonce in the command logic */
     int nonce;
 
@@ -196,6 +217,14 @@ static apr_status_t loc_read_node(int ids, nodeinfo_t **node)
 {
     return (get_node(nodestatsmem, node, ids));
 }
+static apr_status_t loc_read_node_mess(int ids, nodeinfo_t **node, nodemess_t *mess, apr_uint32_t *generation)
+{
+    return (read_node_mess(nodestatsmem, ids, node, mess, generation));
+}
+static apr_status_t loc_read_node_hot(int ids, nodehot_t **hot)
+{
+    return (get_node_hot(nodestatsmem, hot, ids));
+}
 static int loc_get_ids_used_node(int *ids)
 {
     return(get_ids_used_node(nodestatsmem, ids)); 
@@ -207,14 +236,14 @@ static int loc_get_max_size_node(void)
     else
         return 0;
 }
-static apr_status_t loc_remove_node(nodeinfo_t *node)
-{
-    return (remove_node(nodestatsmem, node));
-}
 static apr_status_t loc_find_node(nodeinfo_t **node, const char *route)
 {
     return (find_node(nodestatsmem, node, route));
 }
+static apr_status_t loc_update_node_mess(nodeinfo_t *node, int remove, apr_time_t lastcleantry)
+{
+    return (update_node_mess(nodestatsmem, node, NULL, remove, lastcleantry));
+}
 
 /*
  * Increase the version of the nodes table
@@ -223,7 +252,23 @@ static void inc_version_node(void)
 {
     version_data *base;
     base = (version_data *)apr_shm_baseaddr_get(versionipc_shm);
-    base->counter++;
+    apr_atomic_inc32(&base->counter);
+}
+static apr_status_t loc_remove_node(nodeinfo_t *node)
+{
+    apr_status_t rv = remove_node(nodestatsmem, node);
+    /* the routing snapshots of mod_proxy_cluster must forget the node */
+    inc_version_node();
+    return rv;
+}
+/* Read the version of the nodes table */
+static unsigned int loc_get_version_node(void)
+{
+    version_data *base;
+    if (!versionipc_shm)
+        return 0;
+    base = (version_data *)apr_shm_baseaddr_get(versionipc_shm);
+    return (unsigned int) apr_atomic_read32(&base->counter);
 }
 
 /* Check is the nodes (in shared memory) were modified since last
@@ -245,7 +290,7 @@ static unsigned int loc_worker_nodes_need_update(void *data, apr_pool_t *pool)
         return 0; /* broken */
 
     base = (version_data *)apr_shm_baseaddr_get(versionipc_shm);
-    last = base->counter;
+    last = apr_atomic_read32(&base->counter);
 
     if (last != mconf->tableversion)
         return last;
@@ -275,14 +320,157 @@ static apr_status_t unlock_memory(apr_file_t *file, apr_thread_mutex_t *mutex)
     apr_thread_mutex_unlock(mutex);
     return(apr_file_unlock(file));
 }
+/*
+ * The holder of the nodes lock may change the tables: make their
+ * generation odd until the unlock, the readers without lock retry.
+ */
+static void begin_tables_write(void)
+{
+    version_data *base;
+    apr_uint32_t seq;
+    if (!versionipc_shm)
+        return;
+    base = (version_data *)apr_shm_baseaddr_get(versionipc_shm);
+    seq = apr_atomic_read32(&base->tables);
+    /* a writer that died holding the lock left it odd */
+    apr_atomic_cas32(&base->tables, (seq + 2) | 1, seq);
+}
+static void end_tables_write(void)
+{
+    version_data *base;
+    if (!versionipc_shm)
+        return;
+    base = (version_data *)apr_shm_baseaddr_get(versionipc_shm);
+    apr_atomic_inc32(&base->tables);
+}
+/* The nodes lock without changing the tables (worker stats, locked reads) */
+static apr_status_t loc_lock_nodes_stats(void)
+{
+    apr_status_t rv;
+    if (nodes_global_mem)
+        rv = storage->ap_slotmem_lock(nodes_global_mem);
+    else
+        rv = lock_memory(nodes_global_lock, nodes_global_mutex);
+    if (rv == SLOTMEM_OWNERDEAD) {
+        /* a writer died in the middle of an update: the children must rebuild their workers */
+        inc_version_node();
+        rv = APR_SUCCESS;
+    }
+    return rv;
+}
+static apr_status_t loc_unlock_nodes_stats(void)
+{
+    if (nodes_global_mem)
+        return(storage->ap_slotmem_unlock(nodes_global_mem));
+    return(unlock_memory(nodes_global_lock, nodes_global_mutex));
+}
 static apr_status_t loc_lock_nodes(void)
 {
-    return(lock_memory(nodes_global_lock, nodes_global_mutex));
+    apr_status_t rv = loc_lock_nodes_stats();
+    if (rv == APR_SUCCESS)
+        begin_tables_write();
+    return rv;
 }
 static apr_status_t loc_unlock_nodes(void)
 {
-    return(unlock_memory(nodes_global_lock, nodes_global_mutex));
+    end_tables_write();
+    return(loc_unlock_nodes_stats());
+}
+/*
+ * Take or renew the cluster-wide maintenance lease: only one child does
+ * the health probes and cleans the shared tables. No lock: the children
+ * race for an expired lease with a cas on the leader, the holder renews
+ * it and checks that nobody took it over meanwhile.
+ */
+static int loc_take_maintenance_lease(int lease)
+{
+    version_data *base;
+    apr_uint32_t pid = (apr_uint32_t) getpid();
+    apr_uint32_t now = (apr_uint32_t) apr_time_sec(apr_time_now());
+    apr_uint32_t leader, expires;
+
+    if (!versionipc_shm)
+        return 0;
+    base = (version_data *)apr_shm_baseaddr_get(versionipc_shm);
+    leader = apr_atomic_read32(&base->leader);
+    expires = apr_atomic_read32(&base->lease);
+    if (leader != pid) {
+        if (leader != 0 && now < expires)
+            return 0; /* another child holds it */
+        if (apr_atomic_cas32(&base->leader, pid, leader) != leader)
+            return 0; /* another child took it first */
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, ap_server_conf,
+                     "take_maintenance_lease: child %u takes the lease from %u",
+                     (unsigned int) pid, (unsigned int) leader);
+    }
+    apr_atomic_set32(&base->lease, now + lease);
+    /* the lease expired before the renewal and another child took it */
+    return apr_atomic_read32(&base->leader) == pid;
+}
+/* Give back the lease (the child is exiting) */
+static void loc_release_maintenance_lease(void)
+{
+    version_data *base;
+    if (!versionipc_shm)
+        return;
+    base = (version_data *)apr_shm_baseaddr_get(versionipc_shm);
+    apr_atomic_cas32(&base->leader, 0, (apr_uint32_t) getpid());
+}
+/*
+ * Capacity generation: the waiters of all the children poll it instead
+ * of rescanning the workers; it only moves when somebody waits.
+ */
+static void loc_signal_capacity(void)
+{
+    version_data *base;
+    if (!versionipc_shm)
+        return;
+    base = (version_data *)apr_shm_baseaddr_get(versionipc_shm);
+    if (apr_atomic_read32(&base->waiting))
+        apr_atomic_inc32(&base->capacity);
+}
+static apr_uint32_t loc_get_capacity_generation(void)
+{
+    version_data *base;
+    if (!versionipc_shm)
+        return 0;
+    base = (version_data *)apr_shm_baseaddr_get(versionipc_shm);
+    return apr_atomic_read32(&base->capacity);
+}
+static apr_uint32_t loc_get_tables_generation(void)
+{
+    version_data *base;
+    if (!versionipc_shm)
+        return 0;
+    base = (version_data *)apr_shm_baseaddr_get(versionipc_shm);
+    /* the cas doesn't change anything but orders the reads around it */
+    return apr_atomic_cas32(&base->tables, 0, 0);
 }
+static void loc_wait_begin(void)
+{
+    version_data *base;
+    apr_uint32_t waiting, max;
+    if (!versionipc_shm)
+        return;
+    base = (version_data *)apr_shm_baseaddr_get(versionipc_shm);
+    waiting = apr_atomic_inc32(&base->waiting) + 1;
+    apr_atomic_inc32(&base->waits);
+    do {
+        max = apr_atomic_read32(&base->maxwaiting);
+    } while (waiting > max && apr_atomic_cas32(&base->maxwaiting, waiting, max) != max);
+}
+static void loc_wait_end(apr_interval_time_t waited, int timedout)
+{
+    version_data *base;
+    if (!versionipc_shm)
+        return;
+    base = (version_data *)apr_shm_baseaddr_get(versionipc_shm);
+    apr_atomic_dec32(&base->waiting);
+    apr_atomic_add32(&base->waittime, (apr_uint32_t) apr_time_as_msec(waited));
+    if (timedout)
+        apr_atomic_inc32(&base->waittimeouts);
+}
+
 static int loc_get_max_size_context(void)
 {
     if (contextstatsmem)
@@ -339,9 +527,23 @@ static const struct node_storage_method node_storage =
     loc_worker_nodes_are_updated,
     loc_remove_node,
     loc_find_node,
+    loc_update_node_mess,
     loc_remove_host_context,
     loc_lock_nodes,
-    loc_unlock_nodes
+    loc_unlock_nodes,
+    loc_get_version_node,
+    loc_read_node_mess,
+    loc_read_node_hot,
+    loc_take_maintenance_lease,
+    loc_release_maintenance_lease,
+    loc_signal_capacity,
+    loc_get_capacity_generation,
+    loc_wait_begin,
+    loc_wait_end,
+    loc_get_tables_generation,
+    loc_lock_nodes_stats,
+    loc_unlock_nodes_stats,
+    hash_domain_node
 };
 
 /*
@@ -357,10 +559,20 @@ static int loc_get_ids_used_context(int *ids)
 }
 static apr_status_t loc_lock_contexts(void)
 {
+    if (contexts_global_mem) {
+        apr_status_t rv = storage->ap_slotmem_lock(contexts_global_mem);
+        if (rv == SLOTMEM_OWNERDEAD) {
+            inc_version_node();
+            rv = APR_SUCCESS;
+        }
+        return rv;
+    }
     return(lock_memory(contexts_global_lock, contexts_global_mutex));
 }
 static apr_status_t loc_unlock_contexts(void)
 {
+    if (contexts_global_mem)
+        return(storage->ap_slotmem_unlock(contexts_global_mem));
     return(unlock_memory(contexts_global_lock, contexts_global_mutex));
 }
 static const struct context_storage_method context_storage =
@@ -508,6 +720,8 @@ static apr_status_t cleanup_manager(void *param)
     balancerstatsmem = NULL;
     sessionidstatsmem = NULL;
     domainstatsmem = NULL;
+    nodes_global_mem = NULL;
+    contexts_global_mem = NULL;
     if (nodes_global_lock) {
         apr_file_close(nodes_global_lock);
         nodes_global_lock = NULL;
@@ -627,7 +841,20 @@ static int manager_init(apr_pool_t *p, apr_pool_t *plog,
         ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, s, "ap_lookup_provider %s failed", SLOTMEM_STORAGE);
         return  !OK;
     }
-    nodestatsmem = create_mem_node(node, &mconf->maxnode, mconf->persistent, p, storage);
+    if (mconf->slotlock) {
+        /* the locks of the tables are one slot slotmems with a robust mutex */
+        rv = storage->ap_slotmem_create(&nodes_global_mem, apr_pstrcat(ptemp, node, ".mutex", NULL), sizeof(int), 1,
+                                        CREATE_SLOTMEM|mconf->persistent|mconf->slotlock, p);
+        if (rv == APR_SUCCESS)
+            rv = storage->ap_slotmem_create(&contexts_global_mem, apr_pstrcat(ptemp, context, ".mutex", NULL), sizeof(int), 1,
+                                            CREATE_SLOTMEM|mconf->persistent|mconf->slotlock, p);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s, "manager_init: create robust locks failed");
+            return !OK;
+        }
+    }
+
+    nodestatsmem = create_mem_node(node, &mconf->maxnode, mconf->persistent|mconf->slotlock, p, storage);
     if (nodestatsmem == NULL) {
         ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, s, "create_mem_node %s failed", node);
         return  !OK;
@@ -639,19 +866,19 @@ static int manager_init(apr_pool_t *p, apr_pool_t *plog,
         return  !OK;
     }
 
-    contextstatsmem = create_mem_context(context, &mconf->maxcontext, mconf->persistent, p, storage);
+    contextstatsmem = create_mem_context(context, &mconf->maxcontext, mconf->persistent|mconf->slotlock, p, storage);
     if (contextstatsmem == NULL) {
         ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, s, "create_mem_context failed");
         return  !OK;
     }
 
-    hoststatsmem = create_mem_host(host, &mconf->maxhost, mconf->persistent, p, storage);
+    hoststatsmem = create_mem_host(host, &mconf->maxhost, mconf->persistent|mconf->slotlock, p, storage);
     if (hoststatsmem == NULL) {
         ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, s, "create_mem_host failed");
         return  !OK;
     }
 
-    balancerstatsmem = create_mem_balancer(balancer, &mconf->maxhost, mconf->persistent, p, storage);
+    balancerstatsmem = create_mem_balancer(balancer, &mconf->maxhost, mconf->persistent|mconf->slotlock, p, storage);
     if (balancerstatsmem == NULL) {
         ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, s, "create_mem_balancer failed");
         return  !OK;
@@ -659,14 +886,14 @@ static int manager_init(apr_pool_t *p, apr_pool_t *plog,
 
     if (mconf->maxsessionid) {
         /* Only create sessionid stuff if required */
-        sessionidstatsmem = create_mem_sessionid(sessionid, &mconf->maxsessionid, mconf->persistent, p, storage);
+        sessionidstatsmem = create_mem_sessionid(sessionid, &mconf->maxsessionid, mconf->persistent|mconf->slotlock, p, storage);
         if (sessionidstatsmem == NULL) {
             ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, s, "create_mem_sessionid failed");
             return  !OK;
         }
     }
 
-    domainstatsmem = create_mem_domain(domain, &mconf->maxnode, mconf->persistent, p, storage);
+    domainstatsmem = create_mem_domain(domain, &mconf->maxnode, mconf->persistent|mconf->slotlock, p, storage);
     if (domainstatsmem == NULL) {
         ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, s, "create_mem_domain failed");
         return  !OK;
@@ -692,6 +919,15 @@ static int manager_init(apr_pool_t *p, apr_pool_t *plog,
     }
     base = (version_data *)apr_shm_baseaddr_get(versionipc_shm);
     base->counter = 0;
+    base->leader = 0;
+    base->lease = 0;
+    base->capacity = 0;
+    base->waiting = 0;
+    base->maxwaiting = 0;
+    base->waits = 0;
+    base->waittimeouts = 0;
+    base->waittime = 0;
+    base->tables = 0;
 
     /* Get a provider to ping/pong logics */
 
@@ -1143,14 +1379,17 @@ static char * process_config(request_rec *r, char **ptr, int *errtype)
             nodeinfo.mess.AJPSecret[sizeof(nodeinfo.mess.AJPSecret)-1] = '\0';
         }
     }
+    /* the tables only change under the nodes lock (see get_tables_generation) */
+    loc_lock_nodes();
+
     /* Insert or update balancer description */
     if (insert_update_balancer(balancerstatsmem, &balancerinfo) != APR_SUCCESS) {
+        loc_unlock_nodes();
         *errtype = TYPEMEM;
         return apr_psprintf(r->pool, MBALAUI, nodeinfo.mess.JVMRoute);
     }
 
     /* check for removed node */
-    loc_lock_nodes();
     node = read_node(nodestatsmem, &nodeinfo);
     if (node != NULL) {
         /* If the node is removed (or kill and restarted) and recreated unchanged that is ok: network problems */
@@ -1158,9 +1397,7 @@ static char * process_config(request_rec *r, char **ptr, int *errtype)
             /* Here we can't update it because the old one is still in */
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                          "process_config: node %s already exist", node->mess.JVMRoute);
-            strcpy(node->mess.JVMRoute, "REMOVED");
-            node->mess.remove = 1;
-            insert_update_node(nodestatsmem, node, &id);
+            update_node_mess(nodestatsmem, node, "REMOVED", 1, 0);
             loc_remove_host_context(node->mess.id, r->pool);
             inc_version_node();
             loc_unlock_nodes();
@@ -1170,6 +1407,7 @@ static char * process_config(request_rec *r, char **ptr, int *errtype)
     }
     /* check if a node corresponding to the same worker already exists */
     if (is_same_worker_existing(r, &nodeinfo)) {
+        loc_unlock_nodes();
         *errtype = TYPEMEM;
         return MNODEET;
     }
@@ -1703,9 +1941,7 @@ static char * process_node_cmd(request_rec *r, int status, int *errtype, nodeinf
 
     /* The REMOVE-APP * removes the node (well mark it removed) */
     if (status == REMOVE) {
-        int id;
-        node->mess.remove = 1;
-        insert_update_node(nodestatsmem, node, &id);
+        update_node_mess(nodestatsmem, node, NULL, 1, 0);
     }
     return NULL;
 
@@ -1939,10 +2175,10 @@ static char * process_appl_cmd(request_rec *r, char **ptr, int status, int *errt
         in.node = node->mess.id;
         ou = read_context(contextstatsmem, &in);
         if (ou != NULL) {
-            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "process_appl_cmd: STOP-APP nbrequests %d", ou->nbrequests);
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "process_appl_cmd: STOP-APP nbrequests %u", ou->nbrequests);
             if (fromnode) {
                 ap_set_content_type(r, "text/plain");
-                ap_rprintf(r, "Type=STOP-APP-RSP&JvmRoute=%.*s&Alias=%.*s&Context=%.*s&Requests=%d",
+                ap_rprintf(r, "Type=STOP-APP-RSP&JvmRoute=%.*s&Alias=%.*s&Context=%.*s&Requests=%u",
                            (int) sizeof(nodeinfo.mess.JVMRoute), nodeinfo.mess.JVMRoute,
                            (int) sizeof(vhost->host), vhost->host,
                            (int) sizeof(vhost->context), vhost->context,
@@ -2432,7 +2668,7 @@ static void manager_info_contexts(request_rec *r, int reduce_display, int allow_
                 status = "STOPPED";
                 break;
         }
-        ap_rprintf(r, "%.*s, Status: %s Request: %d ", (int) sizeof(ou->context), ou->context, status, ou->nbrequests);
+        ap_rprintf(r, "%.*s, Status: %s Request: %u ", (int) sizeof(ou->context), ou->context, status, ou->nbrequests);
         if (allow_cmd)
             context_command_string(r, ou, Alias, JVMRoute);
         ap_rprintf(r, "\n");
@@ -2701,6 +2937,14 @@ static void modules_info(request_rec *r)
     else
         ap_rputs("mod_advertise.c: not loaded<br/>", r);
 
+    if (versionipc_shm) {
+        version_data *base = (version_data *)apr_shm_baseaddr_get(versionipc_shm);
+        apr_uint32_t waits = apr_atomic_read32(&base->waits);
+        ap_rprintf(r, "Waiting for a worker: %u (max %u), waits: %u, timeouts: %u, average wait: %u ms<br/>",
+                   apr_atomic_read32(&base->waiting), apr_atomic_read32(&base->maxwaiting),
+                   waits, apr_atomic_read32(&base->waittimeouts),
+                   waits ? apr_atomic_read32(&base->waittime) / waits : 0);
+    }
 }
 /* Process INFO message and mod_cluster_manager pages generation */
 static int manager_info(request_rec *r)
@@ -3235,6 +3479,28 @@ static const char*cmd_manager_pers(cmd_parms *cmd, void *dummy, const char *arg)
     }
     return NULL;
 }
+static const char*cmd_manager_slotlock(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    mod_manager_config *mconf = ap_get_module_config(cmd->server->module_config, &manager_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err != NULL) {
+        return err;
+    }
+    if (strcasecmp(arg, "File") == 0)
+       mconf->slotlock = 0;
+    else if (strcasecmp(arg, "Robust") == 0) {
+#if HAVE_ROBUST_SLOTMEM
+       mconf->slotlock = ROBUST_SLOTMEM;
+#else
+       return "SlotLock robust isn't supported on this platform";
+#endif
+    }
+    else {
+       return "SlotLock must be one of: "
+              "file | robust";
+    }
+    return NULL;
+}
 
 static const char*cmd_manager_nonce(cmd_parms *cmd, void *dummy, const char *arg)
 {
@@ -3414,6 +3680,13 @@ static const command_rec  manager_cmds[] =
         OR_ALL,
         "PersistSlots - Persist the slot mem elements on | off (Default: off No persistence)"
     ),
+    AP_INIT_TAKE1(
+        "SlotLock",
+        cmd_manager_slotlock,
+        NULL,
+        OR_ALL,
+        "SlotLock - Lock of the slot mem and of the tables file | robust (Default: file lock file and mutex)"
+    ),
     AP_INIT_TAKE1(
         "CheckNonce",
         cmd_manager_nonce,
@@ -3522,6 +3795,7 @@ static void *create_manager_config(apr_pool_t *p)
     mconf->maxsessionid = DEFMAXSESSIONID;
     mconf->tableversion = 0;
     mconf->persistent = 0;
+    mconf->slotlock = 0;
     mconf->nonce = -1;
     mconf->balancername = NULL;
     mconf->allow_display = 0;
@@ -3550,6 +3824,7 @@ static void *merge_manager_server_config(apr_pool_t *p, void *server1_conf,
     mconf->maxnode = DEFMAXNODE;
     mconf->tableversion = 0;
     mconf->persistent = 0;
+    mconf->slotlock = 0;
     mconf->nonce = -1;
     mconf->balancername = NULL;
     mconf->allow_display = 0;
@@ -3586,6 +3861,11 @@ static void *merge_manager_server_config(apr_pool_t *p, void *server1_conf,
     else if (mconf1->persistent != 0)
         mconf->persistent = mconf1->persistent;
 
+    if (mconf2->slotlock != 0)
+        mconf->slotlock = mconf2->slotlock;
+    else if (mconf1->slotlock != 0)
+        mconf->slotlock = mconf1->slotlock;
+
     if (mconf2->nonce != -1)
         mconf->nonce = mconf2->nonce;
     else if (mconf1->nonce != -1)
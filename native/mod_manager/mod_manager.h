@@ -27,6 +27,7 @@
 
 struct mem {
     ap_slotmem_t *slotmem;
+    ap_slotmem_t *hotmem; /* hot part of the nodes (only for the node table) */
     const slotmem_storage_method *storage;
     int num;
     apr_pool_t *p;
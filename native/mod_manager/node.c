@@ -38,15 +38,81 @@
 #include "apr_strings.h"
 #include "apr_pools.h"
 #include "apr_time.h"
+#include "apr_atomic.h"
+#include "apr_hash.h"
+#include "apr_thread_proc.h"
 
 #include "slotmem.h"
 #include "node.h"
 
 #include "mod_manager.h"
 
+/**
+ * hash of the domain as stored in nodehot_t
+ * @param domain the domain (NULL or empty: no domain).
+ * @return the hash, never 0 for a domain, 0 without domain.
+ */
+unsigned int hash_domain_node(const char *domain)
+{
+    apr_ssize_t len = APR_HASH_KEY_STRING;
+    if (domain == NULL || *domain == '\0')
+        return 0;
+    return apr_hashfunc_default(domain, &len) | 1;
+}
+
+/* copy the generation and the domain of the node in its hot part */
+static void update_node_hot(mem_t *s, nodeinfo_t *ou, int id, int reset)
+{
+    nodehot_t *hot;
+    if (get_node_hot(s, &hot, id) != APR_SUCCESS)
+        return;
+    if (reset) {
+        /* the counters belong to the previous node of the slot */
+        apr_atomic_set32(&hot->generation, 0);
+        hot->oldelected = 0;
+        hot->num_failure_idle = 0;
+        hot->updatetimelb = 0;
+        apr_atomic_set32(&hot->ewma_latency, 0);
+        apr_atomic_set32(&hot->ewma_errors, 0);
+        apr_atomic_set32(&hot->ejected_until, 0);
+        apr_atomic_set32(&hot->ejections, 0);
+        /* a new node ramps its weight */
+        apr_atomic_set32(&hot->slowstart, (apr_uint32_t) apr_time_sec(apr_time_now()));
+    }
+    hot->domain = hash_domain_node(ou->mess.Domain);
+    apr_atomic_set32(&hot->generation, apr_atomic_read32(&ou->generation));
+}
+
+/* Add a node to the JVMRoute hash index of the table */
+static apr_status_t index_node(void* mem, void **data, int id, apr_pool_t *pool)
+{
+    mem_t *s = (mem_t *) *data;
+    nodeinfo_t *ou = (nodeinfo_t *)mem;
+    s->storage->ap_slotmem_index_add(s->slotmem, ou->mess.JVMRoute, id);
+    update_node_hot(s, ou, id, 1);
+    return APR_NOTFOUND; /* next one */
+}
+
+/* Add a node to the index only: the hot part of a live node must not be reset */
+static apr_status_t reindex_node(void* mem, void **data, int id, apr_pool_t *pool)
+{
+    mem_t *s = (mem_t *) *data;
+    nodeinfo_t *ou = (nodeinfo_t *)mem;
+    s->storage->ap_slotmem_index_add(s->slotmem, ou->mess.JVMRoute, id);
+    return APR_NOTFOUND; /* next one */
+}
+
+/* lock the table, rebuild the index emptied by a process that died holding the lock */
+static void lock_mem_node(mem_t *s)
+{
+    if (s->storage->ap_slotmem_lock(s->slotmem) == SLOTMEM_OWNERDEAD)
+        s->storage->ap_slotmem_do(s->slotmem, reindex_node, &s, s->p);
+}
+
 static mem_t * create_attach_mem_node(char *string, int *num, int type, apr_pool_t *p, slotmem_storage_method *storage) {
     mem_t *ptr;
     const char *storename;
+    const char *hotname;
     apr_status_t rv;
 
     ptr = apr_pcalloc(p, sizeof(mem_t));
@@ -55,11 +121,24 @@ static mem_t * create_attach_mem_node(char *string, int *num, int type, apr_pool
     }
     ptr->storage =  storage;
     storename = apr_pstrcat(p, string, NODEEXE, NULL); 
+    hotname = apr_pstrcat(p, string, NODEHOTEXE, NULL); 
     if (type) {
-        rv = ptr->storage->ap_slotmem_create(&ptr->slotmem, storename, sizeof(nodeinfo_t), *num, type, p);
+        rv = ptr->storage->ap_slotmem_create(&ptr->slotmem, storename, sizeof(nodeinfo_t), *num, type|INDEX_SLOTMEM, p);
+        if (rv == APR_SUCCESS) {
+            /* the hot parts aren't persisted, they are all "allocated": one per node id */
+            int id;
+            void *hot;
+            rv = ptr->storage->ap_slotmem_create(&ptr->hotmem, hotname, sizeof(nodehot_t), *num, CREATE_SLOTMEM, p);
+            while (rv == APR_SUCCESS && ptr->storage->ap_slotmem_alloc(ptr->hotmem, &id, &hot) == APR_SUCCESS);
+        }
     } else {
         apr_size_t size = sizeof(nodeinfo_t);
         rv = ptr->storage->ap_slotmem_attach(&ptr->slotmem, storename, &size, num, p);
+        if (rv == APR_SUCCESS) {
+            int hotnum;
+            size = sizeof(nodehot_t);
+            rv = ptr->storage->ap_slotmem_attach(&ptr->hotmem, hotname, &size, &hotnum, p);
+        }
     }
     if (rv != APR_SUCCESS) {
         ptr->laststatus = rv;
@@ -68,6 +147,12 @@ static mem_t * create_attach_mem_node(char *string, int *num, int type, apr_pool
     ptr->laststatus = APR_SUCCESS;
     ptr->num = *num;
     ptr->p = p;
+    if (type) {
+        /* the index of a mapped file may be stale and a migrated table has none: (re)index the nodes */
+        ptr->storage->ap_slotmem_lock(ptr->slotmem);
+        ptr->storage->ap_slotmem_do(ptr->slotmem, index_node, &ptr, p);
+        ptr->storage->ap_slotmem_unlock(ptr->slotmem);
+    }
     return ptr;
 }
 
@@ -82,6 +167,21 @@ apr_status_t get_last_mem_error(mem_t *mem) {
 }
 
 
+/*
+ * seqlock on the node record: the writers are serialized by the slotmem
+ * lock, the readers retry when the record was changed while copying it.
+ * A sequence left odd by a crashed writer is fixed by the next writer.
+ */
+static void write_begin_node(nodeinfo_t *ou)
+{
+    apr_uint32_t seq = apr_atomic_read32(&ou->seq);
+    apr_atomic_cas32(&ou->seq, seq | 1, seq);
+}
+static void write_end_node(nodeinfo_t *ou)
+{
+    apr_atomic_inc32(&ou->seq);
+}
+
 /**
  * Insert(alloc) and update a node record in the shared table
  * @param pointer to the shared table.
@@ -101,11 +201,13 @@ static apr_status_t insert_update(void* mem, void **data, int id, apr_pool_t *po
          * offset (of the area shared with the proxy logic).
          * stat (shared area with the proxy logic we shouldn't modify it here).
          */
-        memcpy(ou, in, sizeof(nodemess_t));
+        write_begin_node(ou);
+        if (ou != in)
+            memcpy(ou, in, sizeof(nodemess_t));
         ou->mess.id = id;
         ou->updatetime = apr_time_now();
-        ou->offset = sizeof(nodemess_t) + sizeof(apr_time_t) + sizeof(int);
-        ou->offset = APR_ALIGN_DEFAULT(ou->offset);
+        ou->offset = APR_ALIGN_DEFAULT(APR_OFFSETOF(nodeinfo_t, stat));
+        write_end_node(ou);
         *data = ou;
         return APR_SUCCESS;
     }
@@ -118,11 +220,12 @@ apr_status_t insert_update_node(mem_t *s, nodeinfo_t *node, int *id)
     int ident;
     apr_time_t now;
 
-    node->mess.id = 0;
     now = apr_time_now();
-    s->storage->ap_slotmem_lock(s->slotmem);
-    rv = s->storage->ap_slotmem_do(s->slotmem, insert_update, &node, s->p);
+    lock_mem_node(s);
+    node->mess.id = 0;
+    rv = s->storage->ap_slotmem_index_do(s->slotmem, node->mess.JVMRoute, insert_update, &node, s->p);
     if (node->mess.id != 0 && rv == APR_SUCCESS) {
+        update_node_hot(s, node, node->mess.id, 0);
         s->storage->ap_slotmem_unlock(s->slotmem);
         *id = node->mess.id;
         return APR_SUCCESS; /* updated */
@@ -134,23 +237,59 @@ apr_status_t insert_update_node(mem_t *s, nodeinfo_t *node, int *id)
         s->storage->ap_slotmem_unlock(s->slotmem);
         return rv;
     }
-    memcpy(ou, node, sizeof(nodeinfo_t));
+    /* the slot keeps its sequence and generation: readers may still look at it */
+    write_begin_node(ou);
+    memcpy(ou, node, sizeof(nodemess_t));
     ou->mess.id = ident;
     *id = ident;
     ou->updatetime = now;
+    apr_atomic_inc32(&ou->generation);
+    s->storage->ap_slotmem_index_add(s->slotmem, ou->mess.JVMRoute, ident);
 
     /* set of offset to the proxy_worker_stat */
-    ou->offset = sizeof(nodemess_t) + sizeof(apr_time_t) + sizeof(int);
-    ou->offset = APR_ALIGN_DEFAULT(ou->offset);
+    ou->offset = APR_ALIGN_DEFAULT(APR_OFFSETOF(nodeinfo_t, stat));
 
     /* blank the proxy status information */
     memset(&(ou->stat), '\0', SIZEOFSCORE);
+    write_end_node(ou);
+    update_node_hot(s, ou, ident, 1);
 
     s->storage->ap_slotmem_unlock(s->slotmem);
 
     return APR_SUCCESS;
 }
 
+/**
+ * change a node record of the shared table in place (seqlock)
+ * @param pointer to the shared table.
+ * @param node the node record in the shared table.
+ * @param route new JVMRoute (NULL: unchanged).
+ * @param remove 1 to mark the node removed (0: unchanged).
+ * @param lastcleantry time of the last try to remove the worker (0: unchanged).
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t update_node_mess(mem_t *s, nodeinfo_t *node, const char *route, int remove, apr_time_t lastcleantry)
+{
+    lock_mem_node(s);
+    /* the removal delay starts when the node is marked removed */
+    if (remove && !node->mess.remove)
+        node->updatetime = apr_time_now();
+    write_begin_node(node);
+    if (route) {
+        strncpy(node->mess.JVMRoute, route, sizeof(node->mess.JVMRoute));
+        node->mess.JVMRoute[sizeof(node->mess.JVMRoute) - 1] = '\0';
+    }
+    if (remove)
+        node->mess.remove = 1;
+    if (lastcleantry)
+        node->mess.lastcleantry = lastcleantry;
+    write_end_node(node);
+    if (route)
+        s->storage->ap_slotmem_index_add(s->slotmem, node->mess.JVMRoute, node->mess.id);
+    s->storage->ap_slotmem_unlock(s->slotmem);
+    return APR_SUCCESS;
+}
+
 /**
  * read a node record from the shared table
  * @param pointer to the shared table.
@@ -174,12 +313,49 @@ nodeinfo_t * read_node(mem_t *s, nodeinfo_t *node)
     if (node->mess.id)
         rv = s->storage->ap_slotmem_mem(s->slotmem, node->mess.id, (void **) &ou);
     else {
-        rv = s->storage->ap_slotmem_do(s->slotmem, loc_read_node, &ou, s->p);
+        rv = s->storage->ap_slotmem_index_do(s->slotmem, node->mess.JVMRoute, loc_read_node, &ou, s->p);
     }
     if (rv == APR_SUCCESS)
         return ou;
     return NULL;
 }
+
+/**
+ * read a consistent copy of a node record without locking (seqlock)
+ * @param pointer to the shared table.
+ * @param ids ident of the node to read.
+ * @param node address to return the node in the shared table.
+ * @param mess where to copy the node configuration.
+ * @param generation where to copy the generation of the slot.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t read_node_mess(mem_t *s, int ids, nodeinfo_t **node, nodemess_t *mess, apr_uint32_t *generation)
+{
+    apr_status_t rv;
+    apr_uint32_t seq;
+    nodeinfo_t *ou;
+    int tries = 0;
+
+    rv = s->storage->ap_slotmem_mem(s->slotmem, ids, (void **) &ou);
+    if (rv != APR_SUCCESS)
+        return rv;
+    for (;;) {
+        seq = apr_atomic_read32(&ou->seq);
+        if (!(seq & 1)) {
+            memcpy(mess, &ou->mess, sizeof(nodemess_t));
+            *generation = ou->generation;
+            /* the cas doesn't change anything but orders the reads before it */
+            if (apr_atomic_cas32(&ou->seq, seq, seq) == seq)
+                break;
+        }
+        if (++tries > 1000)
+            return APR_EAGAIN; /* a writer is stuck */
+        apr_thread_yield();
+    }
+    *node = ou;
+    return APR_SUCCESS;
+}
+
 /**
  * get a node record from the shared table (using ids).
  * @param pointer to the shared table.
@@ -190,12 +366,24 @@ nodeinfo_t * read_node(mem_t *s, nodeinfo_t *node)
 apr_status_t get_node(mem_t *s, nodeinfo_t **node, int ids)
 {
   apr_status_t status;
-  s->storage->ap_slotmem_lock(s->slotmem);
+  lock_mem_node(s);
   status = s->storage->ap_slotmem_mem(s->slotmem, ids, (void **) node);
   s->storage->ap_slotmem_unlock(s->slotmem);
   return(status);
 }
 
+/**
+ * get the hot part of a node (without locking)
+ * @param pointer to the shared table.
+ * @param hot address of the hot part in the shared table.
+ * @param ids ident of the node.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t get_node_hot(mem_t *s, nodehot_t **hot, int ids)
+{
+    return s->storage->ap_slotmem_mem(s->hotmem, ids, (void **) hot);
+}
+
 /**
  * remove(free) a node record from the shared table
  * @param pointer to the shared table.
@@ -210,10 +398,17 @@ apr_status_t remove_node(mem_t *s, nodeinfo_t *node)
         rv = s->storage->ap_slotmem_free(s->slotmem, node->mess.id, node);
     else {
         /* XXX: for the moment January 2007 ap_slotmem_free only uses ident to remove */
-        rv = s->storage->ap_slotmem_do(s->slotmem, loc_read_node, &ou, s->p);
+        rv = s->storage->ap_slotmem_index_do(s->slotmem, node->mess.JVMRoute, loc_read_node, &ou, s->p);
         if (rv == APR_SUCCESS)
             rv = s->storage->ap_slotmem_free(s->slotmem, ou->mess.id, node);
     }
+    if (rv == SLOTMEM_OWNERDEAD) {
+        /* ap_slotmem_free() emptied the index */
+        lock_mem_node(s);
+        s->storage->ap_slotmem_do(s->slotmem, reindex_node, &s, s->p);
+        s->storage->ap_slotmem_unlock(s->slotmem);
+        rv = APR_SUCCESS;
+    }
     return rv;
 }
 
@@ -232,7 +427,7 @@ apr_status_t find_node(mem_t *s, nodeinfo_t **node, const char *route)
     strncpy(ou.mess.JVMRoute, route, sizeof(ou.mess.JVMRoute));
     ou.mess.JVMRoute[sizeof(ou.mess.JVMRoute) - 1] = '\0';
     *node = &ou;
-    rv = s->storage->ap_slotmem_do(s->slotmem, loc_read_node, node, s->p);
+    rv = s->storage->ap_slotmem_index_do(s->slotmem, ou.mess.JVMRoute, loc_read_node, node, s->p);
     return rv;
 }
 
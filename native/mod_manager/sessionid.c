@@ -44,6 +44,22 @@
 
 #include "mod_manager.h"
 
+/* Add a sessionid to the hash index of the table */
+static apr_status_t index_sessionid(void* mem, void **data, int id, apr_pool_t *pool)
+{
+    mem_t *s = (mem_t *) *data;
+    sessionidinfo_t *ou = (sessionidinfo_t *)mem;
+    s->storage->ap_slotmem_index_add(s->slotmem, ou->sessionid, id);
+    return APR_NOTFOUND; /* next one */
+}
+
+/* lock the table, rebuild the index emptied by a process that died holding the lock */
+static void lock_mem_sessionid(mem_t *s)
+{
+    if (s->storage->ap_slotmem_lock(s->slotmem) == SLOTMEM_OWNERDEAD)
+        s->storage->ap_slotmem_do(s->slotmem, index_sessionid, &s, s->p);
+}
+
 static mem_t * create_attach_mem_sessionid(char *string, int *num, int type, apr_pool_t *p, slotmem_storage_method *storage) {
     mem_t *ptr;
     const char *storename;
@@ -56,7 +72,7 @@ static mem_t * create_attach_mem_sessionid(char *string, int *num, int type, apr
     ptr->storage =  storage;
     storename = apr_pstrcat(p, string, SESSIONIDEXE, NULL); 
     if (type)
-        rv = ptr->storage->ap_slotmem_create(&ptr->slotmem, storename, sizeof(sessionidinfo_t), *num, type, p);
+        rv = ptr->storage->ap_slotmem_create(&ptr->slotmem, storename, sizeof(sessionidinfo_t), *num, type|INDEX_SLOTMEM, p);
     else {
         apr_size_t size = sizeof(sessionidinfo_t);
         rv = ptr->storage->ap_slotmem_attach(&ptr->slotmem, storename, &size, num, p);
@@ -66,6 +82,12 @@ static mem_t * create_attach_mem_sessionid(char *string, int *num, int type, apr
     }
     ptr->num = *num;
     ptr->p = p;
+    if (type) {
+        /* the index of a mapped file may be stale and a migrated table has none: (re)index the sessionids */
+        ptr->storage->ap_slotmem_lock(ptr->slotmem);
+        ptr->storage->ap_slotmem_do(ptr->slotmem, index_sessionid, &ptr, p);
+        ptr->storage->ap_slotmem_unlock(ptr->slotmem);
+    }
     return ptr;
 }
 /**
@@ -95,8 +117,8 @@ apr_status_t insert_update_sessionid(mem_t *s, sessionidinfo_t *sessionid)
     int ident;
 
     sessionid->id = 0;
-    s->storage->ap_slotmem_lock(s->slotmem);
-    rv = s->storage->ap_slotmem_do(s->slotmem, insert_update, &sessionid, s->p);
+    lock_mem_sessionid(s);
+    rv = s->storage->ap_slotmem_index_do(s->slotmem, sessionid->sessionid, insert_update, &sessionid, s->p);
     if (sessionid->id != 0 && rv == APR_SUCCESS) {
         s->storage->ap_slotmem_unlock(s->slotmem);
         return APR_SUCCESS; /* updated */
@@ -110,6 +132,7 @@ apr_status_t insert_update_sessionid(mem_t *s, sessionidinfo_t *sessionid)
     }
     memcpy(ou, sessionid, sizeof(sessionidinfo_t));
     ou->id = ident;
+    s->storage->ap_slotmem_index_add(s->slotmem, ou->sessionid, ident);
     s->storage->ap_slotmem_unlock(s->slotmem);
     ou->updatetime = apr_time_sec(apr_time_now());
 
@@ -140,7 +163,7 @@ sessionidinfo_t * read_sessionid(mem_t *s, sessionidinfo_t *sessionid)
     if (sessionid->id)
         rv = s->storage->ap_slotmem_mem(s->slotmem, sessionid->id, (void **) &ou);
     else {
-        rv = s->storage->ap_slotmem_do(s->slotmem, loc_read_sessionid, &ou, s->p);
+        rv = s->storage->ap_slotmem_index_do(s->slotmem, sessionid->sessionid, loc_read_sessionid, &ou, s->p);
     }
     if (rv == APR_SUCCESS)
         return ou;
@@ -172,10 +195,17 @@ apr_status_t remove_sessionid(mem_t *s, sessionidinfo_t *sessionid)
         rv = s->storage->ap_slotmem_free(s->slotmem, sessionid->id, sessionid);
     } else {
         /* XXX: for the moment January 2007 ap_slotmem_free only uses ident to remove */
-        rv = s->storage->ap_slotmem_do(s->slotmem, loc_read_sessionid, &ou, s->p);
+        rv = s->storage->ap_slotmem_index_do(s->slotmem, sessionid->sessionid, loc_read_sessionid, &ou, s->p);
         if (rv == APR_SUCCESS)
             rv = s->storage->ap_slotmem_free(s->slotmem, ou->id, sessionid);
     }
+    if (rv == SLOTMEM_OWNERDEAD) {
+        /* ap_slotmem_free() emptied the index */
+        lock_mem_sessionid(s);
+        s->storage->ap_slotmem_do(s->slotmem, index_sessionid, &s, s->p);
+        s->storage->ap_slotmem_unlock(s->slotmem);
+        rv = APR_SUCCESS;
+    }
     return rv;
 }
 
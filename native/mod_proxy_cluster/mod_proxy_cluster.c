@@ -28,6 +28,8 @@
 #include "apr_strings.h"
 #include "apr_version.h"
 #include "apr_thread_cond.h"
+#include "apr_hash.h"
+#include "apr_atomic.h"
 
 #include "httpd.h"
 #include "http_config.h"
@@ -70,10 +72,27 @@
 #define MC_NO_FAILOVER "MC_NF"
 
 
+module AP_MODULE_DECLARE_DATA proxy_cluster_module;
+
+/* workers of a VirtualHost by node id, sized for the node table in post_config */
+struct proxy_worker_index {
+    int size;
+    proxy_worker **workers;
+};
+typedef struct proxy_worker_index proxy_worker_index;
+
+/* one per server_rec (see unshare_server_conf()), in each child */
+struct proxy_cluster_server_conf {
+    apr_uint32_t workers_version; /* version of the node table + 1 the workers were created from (0: never) */
+    proxy_worker_index *index; /* read without lock, the slots are changed under lock */
+};
+typedef struct proxy_cluster_server_conf proxy_cluster_server_conf;
+
 struct proxy_cluster_helper {
-    int count_active; /* currently active request using the worker */
+    apr_uint32_t count_active; /* currently active request using the worker (apr_atomic) */
     proxy_worker_shared *shared;
     int index; /* like the worker->id */
+    apr_uint32_t generation; /* generation of the node slot when index was set */
 };
 typedef struct  proxy_cluster_helper proxy_cluster_helper;
 
@@ -90,6 +109,7 @@ static apr_thread_cond_t *exit_cond = NULL;
 static int watchdog_must_terminate = 0;
 
 static server_rec *main_server = NULL;
+static int defer_worker_init = 0; /* workers created in post_config are initialized by the children */
 #define CREAT_ALL  0 /* create balancers/workers in all VirtualHost */
 #define CREAT_NONE 1 /* don't create balancers (but add workers) */
 #define CREAT_ROOT 2 /* Only create balancers/workers in the main server */
@@ -98,6 +118,23 @@ static int creat_bal = CREAT_ROOT;
 static int use_alias = 0; /* 1 : Compare Alias with server_name */
 static int deterministic_failover = 0;
 
+#define LBMETHOD_BYREQUESTS       0 /* lbstatus and elected since the last recalculation */
+#define LBMETHOD_LEASTOUTSTANDING 1 /* best of 2 random workers by busy/lbfactor */
+static int lbmethod = LBMETHOD_BYREQUESTS;
+
+static int slow_start = 0; /* seconds to ramp the weight of a new or recovered node (0: no ramp) */
+#define SLOWSTART_MIN 10   /* weight at the beginning of the ramp in percent */
+
+static int outlier_detection = 0; /* eject the nodes that are slow or fail compared to the others */
+static int outlier_ejection_time = 10; /* base ejection time in seconds, doubled for each consecutive ejection */
+
+#define EWMA_SHIFT             3      /* weight of a new sample: 1/8 */
+#define OUTLIER_ERRORS         32768  /* more than 50% of 5xx */
+#define OUTLIER_LATENCY_FACTOR 3      /* slower than 3 times the average of the other nodes */
+#define OUTLIER_MIN_LATENCY    100000 /* but don't care below 100 ms */
+#define OUTLIER_MAX_BACKOFF    6      /* at most outlier_ejection_time * 64 */
+#define OUTLIER_BACKOFF(hot)   ((hot)->ejections < OUTLIER_MAX_BACKOFF ? (hot)->ejections : OUTLIER_MAX_BACKOFF)
+
 static apr_time_t lbstatus_recalc_time = apr_time_from_sec(5); /* recalcul the lbstatus based on number of request in the time interval */
 
 static apr_time_t wait_for_remove =  apr_time_from_sec(10); /* wait until that before removing a removed node */
@@ -106,6 +143,34 @@ static int enable_options = -1; /* Use OPTIONS * for CPING/CPONG */
 
 #define TIMESESSIONID 300                    /* after 5 minutes the sessionid have probably timeout */
 #define TIMEDOMAIN    300                    /* after 5 minutes the sessionid have probably timeout */
+#define MAX_PROBE_THREADS 8                  /* concurrent cping/cpong of the watchdog */
+#define MAINTENANCE_LEASE 20                 /* seconds, longer than a watchdog pass with hung nodes */
+
+/* bitsets used by the routing index */
+#define CLUSTER_BITSET_SIZE(n)     (((n) + 8) / 8)
+#define CLUSTER_BITSET_SET(b, i)   ((b)[(i) >> 3] |= (unsigned char) (1 << ((i) & 7)))
+#define CLUSTER_BITSET_ISSET(b, i) ((b)[(i) >> 3] & (1 << ((i) & 7)))
+
+/* Trie of the context paths: one element per character */
+struct proxy_context_trie
+{
+	char c;
+	struct proxy_context_trie *child;
+	struct proxy_context_trie *next;
+	apr_array_header_t *contexts; /* index in context_info of the contexts ending here */
+};
+typedef struct proxy_context_trie proxy_context_trie;
+
+/* Routing index compiled with the context table (see build_context_index()) */
+struct proxy_context_index
+{
+	proxy_context_trie root;
+	apr_hash_t *aliases;      /* host alias -> bitset of the contexts of the virtual hosts */
+	apr_hash_t *balancers;    /* balancer name (lower case) -> bitset of the contexts of its nodes */
+	unsigned char *withnode;  /* bitset of the contexts whose node is in the node table */
+	int maxnode;              /* biggest id in the node table */
+};
+typedef struct proxy_context_index proxy_context_index;
 
 /* Context table copy for local use */
 struct proxy_context_table
@@ -113,6 +178,7 @@ struct proxy_context_table
 	int sizecontext;
 	int* contexts;
 	contextinfo_t* context_info;
+	proxy_context_index *index;
 };
 typedef struct proxy_context_table proxy_context_table;
 
@@ -140,10 +206,97 @@ struct proxy_node_table
 {
 	int sizenode;
 	int* nodes;
-	nodeinfo_t*  node_info;
+	nodemess_t*  node_info; /* configuration of the nodes (without the proxy status) */
 };
 typedef struct proxy_node_table proxy_node_table;
 
+/*
+ * Routing tables of the process: an immutable copy of the shared tables
+ * rebuilt when the version of the nodes table changes. The requests pin
+ * the current one (refcount) and release it when their pool is cleaned.
+ */
+struct proxy_cluster_snapshot
+{
+	apr_pool_t *pool;
+	unsigned int version;
+	int refcount;  /* protected by snapshot_lock, current_snapshot holds one */
+	proxy_vhost_table vhost_table;
+	proxy_context_table context_table;
+	proxy_balancer_table balancer_table;
+	proxy_node_table node_table;
+};
+typedef struct proxy_cluster_snapshot proxy_cluster_snapshot;
+
+static proxy_cluster_snapshot *current_snapshot = NULL;
+static apr_thread_mutex_t *snapshot_lock = NULL;
+static apr_pool_t *snapshot_pool = NULL;
+static int snapshot_building = 0; /* a thread builds the next snapshot (snapshot_lock) */
+#define SNAPSHOT_TRIES 3 /* copies without the nodes lock before taking it */
+
+/*
+ * Requests waiting for a usable worker of a balancer (balancer timeout):
+ * a FIFO per balancer, each waiter has its condition. Only a node of the
+ * balancer coming back or changing its load wakes them: the balancing
+ * methods ignore busy, a freed connection doesn't make a worker usable.
+ */
+struct proxy_cluster_waiter
+{
+	apr_thread_cond_t *cond;
+	int woken;
+	struct proxy_cluster_waiter *next;
+};
+typedef struct proxy_cluster_waiter proxy_cluster_waiter;
+
+struct proxy_cluster_waitq
+{
+	proxy_cluster_waiter *head;
+	proxy_cluster_waiter *tail;
+	int depth;
+};
+typedef struct proxy_cluster_waitq proxy_cluster_waitq;
+
+static apr_thread_mutex_t *wait_lock = NULL;
+static apr_hash_t *wait_queues = NULL;    /* proxy_cluster_waitq by balancer name, protected by wait_lock */
+static apr_pool_t *wait_pool = NULL;
+static apr_uint32_t local_waiting = 0;    /* waiters in this child, read without lock */
+static int wait_queue_size = 64;          /* max waiters per balancer and child */
+
+static void wake_waiters(const char *balancer);
+
+/*
+ * Sticky routes already resolved by this child: (balancer, route) to the
+ * domain and the worker. An entry is only valid for the version of the
+ * node table it was resolved with. The LRU is split in stripes with their
+ * own lock to keep the threads apart.
+ */
+#define ROUTE_CACHE_STRIPES 16
+struct proxy_route_entry
+{
+	char key[sizeof(proxy_balancer *) + JVMROUTESZ + 1]; /* balancer pointer + route */
+	apr_ssize_t klen;
+	unsigned int version;
+	int hasdomain;
+	char domain[DOMAINNDSZ];
+	proxy_worker *worker; /* NULL: not resolved yet */
+	struct proxy_route_entry *prev;
+	struct proxy_route_entry *next;
+};
+typedef struct proxy_route_entry proxy_route_entry;
+
+struct proxy_route_stripe
+{
+	apr_thread_mutex_t *lock;
+	apr_hash_t *entries; /* and the entries in its pool, only used under lock */
+	proxy_route_entry *mru; /* most recently used first */
+	proxy_route_entry *lru;
+	int count;
+	int max;
+};
+typedef struct proxy_route_stripe proxy_route_stripe;
+
+static proxy_route_stripe *route_cache = NULL;
+static int route_cache_size = 1024;       /* entries per child (0: no cache) */
+
 /* table of node and context selected by find_node_context_host() */
 struct node_context
 {
@@ -152,23 +305,31 @@ struct node_context
 };
 typedef struct node_context node_context;
 
-static int proxy_worker_cmp(const void *a, const void *b)
+/*
+ * Hashes of the deterministic failover: 64 bits FNV-1a of the session id
+ * and of the route, mixed with the finalizer of MurmurHash3 so that each
+ * bit of the score depends on both.
+ */
+#define FNV_OFFSET APR_UINT64_C(0xcbf29ce484222325)
+#define FNV_PRIME  APR_UINT64_C(0x100000001b3)
+static apr_uint64_t hash_fnv1a(const char *str, apr_size_t len)
 {
-    const char *route1 = (*(proxy_worker **) a)->s->route;
-    const char *route2 = (*(proxy_worker **) b)->s->route;
-    return strcmp(route1, route2);
+    apr_uint64_t h = FNV_OFFSET;
+    apr_size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) str[i];
+        h *= FNV_PRIME;
+    }
+    return h;
 }
-
-/* compare proxy host with node host */
-static int compare_hostname(char *proxyhostname, char *nodehostname)
+static apr_uint64_t hash_mix(apr_uint64_t h)
 {
-    if (nodehostname[0] == '[') {
-       char *ptr = nodehostname;
-       ptr++;
-       return strncasecmp(ptr, proxyhostname, strlen(ptr)-1);
-    } else {
-       return strcasecmp(proxyhostname, nodehostname);
-    }
+    h ^= h >> 33;
+    h *= APR_UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= APR_UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    return h;
 }
 
 static char * normalize_hostname(apr_pool_t *p, char *hostname)
@@ -185,6 +346,56 @@ static char * normalize_hostname(apr_pool_t *p, char *hostname)
 static int (*ap_proxy_retry_worker_fn)(const char *proxy_function,
         proxy_worker *worker, server_rec *s) = NULL;
 
+/*
+ * Without merger a VirtualHost without mod_proxy_cluster directive shares
+ * the conf of the main server: give it its own one, its workers aren't
+ * the ones of the main server.
+ */
+static void unshare_server_conf(server_rec *s, apr_pool_t *pool)
+{
+    proxy_cluster_server_conf *mconf = ap_get_module_config(s->module_config, &proxy_cluster_module);
+
+    for (s = s->next; s; s = s->next) {
+        proxy_cluster_server_conf *cconf = ap_get_module_config(s->module_config, &proxy_cluster_module);
+        if (cconf == NULL || cconf == mconf) {
+            cconf = apr_pcalloc(pool, sizeof(proxy_cluster_server_conf));
+            ap_set_module_config(s->module_config, &proxy_cluster_module, cconf);
+        }
+    }
+}
+
+/*
+ * Create the worker index of each VirtualHost in post_config: the node
+ * ids go from 1 to the size of the node table, fixed until the next
+ * restart, so it never grows.
+ */
+static void create_worker_index(server_rec *s, apr_pool_t *pool)
+{
+    int size = node_storage->get_max_size_node() + 1;
+
+    for (; s; s = s->next) {
+        proxy_cluster_server_conf *cconf = ap_get_module_config(s->module_config, &proxy_cluster_module);
+        cconf->index = apr_palloc(pool, sizeof(proxy_worker_index));
+        cconf->index->size = size;
+        cconf->index->workers = apr_pcalloc(pool, sizeof(proxy_worker *) * size);
+    }
+}
+
+/*
+ * Remember the worker of the node id for the VirtualHost: the writers
+ * hold the lock mutex of the child (or run in post_config before the
+ * children exist), the readers don't lock.
+ */
+static void set_worker_index(server_rec *server, int id, proxy_worker *worker)
+{
+    proxy_cluster_server_conf *cconf = ap_get_module_config(server->module_config, &proxy_cluster_module);
+    proxy_worker_index *index = cconf->index;
+
+    if (index == NULL || id < 0 || id >= index->size)
+        return;
+    index->workers[id] = worker;
+}
+
 /**
  * Add a node to the worker conf
  * XXX: Contains code of ap_proxy_initialize_worker (proxy_util.c)
@@ -268,6 +479,16 @@ static apr_status_t create_worker(proxy_server_conf *conf, proxy_balancer *balan
                          "Created: reusing worker for %s", url);
             pptr = pptr + node->offset;
             if (helper->index == node->mess.id && worker->s == (proxy_worker_shared *) pptr) {
+                helper->generation = apr_atomic_read32(&node->generation);
+                set_worker_index(server, node->mess.id, worker);
+                /* created by the parent before the fork */
+                if (!defer_worker_init && !(worker->local_status & PROXY_WORKER_INITIALIZED)) {
+                    if ((rv = ap_proxy_initialize_worker(worker, server, conf->pool)) != APR_SUCCESS) {
+                        ap_log_error(APLOG_MARK, APLOG_ERR, rv, server,
+                                     "ap_proxy_initialize_worker failed %d for %s", rv, url);
+                        return rv;
+                    }
+                }
                 /* the share memory may have been removed and recreated */
                 if (!worker->s->status) {
                     worker->s->status = PROXY_WORKER_INITIALIZED;
@@ -292,8 +513,10 @@ static apr_status_t create_worker(proxy_server_conf *conf, proxy_balancer *balan
                 worker->s = (proxy_worker_shared *) ptr;
                 worker->s->was_malloced = 0; /* Prevent mod_proxy to free it */
                 helper->index = node->mess.id;
+                helper->generation = apr_atomic_read32(&node->generation);
+                set_worker_index(server, node->mess.id, worker);
 
-                if ((rv = ap_proxy_initialize_worker(worker, server, conf->pool)) != APR_SUCCESS) {
+                if (!defer_worker_init && (rv = ap_proxy_initialize_worker(worker, server, conf->pool)) != APR_SUCCESS) {
                     ap_log_error(APLOG_MARK, APLOG_ERR, rv, server,
                                  "ap_proxy_initialize_worker failed %d for %s", rv, url);
                     return rv;
@@ -310,12 +533,14 @@ static apr_status_t create_worker(proxy_server_conf *conf, proxy_balancer *balan
      * 2 - it is the BalancerMember and we try to change the shared status.
      * 3 - we are reusing a removed worker.
      */
-    node_storage->lock_nodes();
+    node_storage->lock_nodes_stats();
     ptr = (char *) node;
     ptr = ptr + node->offset;
     shared = worker->s;
     worker->s = (proxy_worker_shared *) ptr;
     helper->index = node->mess.id;
+    helper->generation = apr_atomic_read32(&node->generation);
+    set_worker_index(server, node->mess.id, worker);
 
     /* Changing the shared memory requires looking it... */
     if (strncmp(worker->s->name, shared->name, sizeof(worker->s->name))) {
@@ -354,10 +579,10 @@ static apr_status_t create_worker(proxy_server_conf *conf, proxy_balancer *balan
         worker->s->retry = apr_time_from_sec(PROXY_WORKER_DEFAULT_RETRY);
     }
 
-    if ((rv = ap_proxy_initialize_worker(worker, server, conf->pool)) != APR_SUCCESS) {
+    if (!defer_worker_init && (rv = ap_proxy_initialize_worker(worker, server, conf->pool)) != APR_SUCCESS) {
         ap_log_error(APLOG_MARK, APLOG_ERR, rv, server,
                      "ap_proxy_initialize_worker failed %d for %s", rv, url);
-        node_storage->unlock_nodes();
+        node_storage->unlock_nodes_stats();
         return rv;
     }
 
@@ -372,7 +597,7 @@ static apr_status_t create_worker(proxy_server_conf *conf, proxy_balancer *balan
         worker->s->lbfactor = -1; /* prevent using the node using status message */
     }
 
-    node_storage->unlock_nodes();
+    node_storage->unlock_nodes_stats();
     return rv;
 }
 
@@ -597,39 +822,29 @@ static void add_balancers_workers_for_server(nodeinfo_t *node, apr_pool_t *pool,
 
 
 /* the worker corresponding to the id, note that we need to compare the shared memory pointer too */
-static proxy_worker *get_worker_from_id_stat(proxy_server_conf *conf, int id, proxy_worker_shared *stat, nodeinfo_t *node)
+static proxy_worker *get_worker_from_id_stat(server_rec *server, int id, proxy_worker_shared *stat, nodeinfo_t *node)
 {
-    int i;
-    char *ptr = conf->balancers->elts;
-    int sizeb = conf->balancers->elt_size;
-    int sizew = sizeof(proxy_worker *);
-
-    for (i = 0; i < conf->balancers->nelts; i++, ptr=ptr+sizeb) {
-        int j;
-        char *ptrw;
-        proxy_balancer *balancer = (proxy_balancer *) ptr;
-        ptrw = balancer->workers->elts;
-        for (j = 0; j < balancer->workers->nelts; j++,  ptrw=ptrw+sizew) {
-            proxy_worker **worker = (proxy_worker **) ptrw;
-            proxy_cluster_helper *helper = (proxy_cluster_helper *) (*worker)->context;
-            if ((*worker)->s == stat && helper->index == id) {
+    proxy_cluster_server_conf *cconf = ap_get_module_config(server->module_config, &proxy_cluster_module);
+    proxy_worker_index *index = cconf->index;
+    proxy_worker *worker;
+    proxy_cluster_helper *helper;
 
-                /* Check that the worker is really the one we need */
-                char sport[7];
-                apr_snprintf(sport, sizeof(sport), "%d", (*worker)->s->port);
-                if (strcmp((*worker)->s->scheme, node->mess.Type) ||
-                    compare_hostname((*worker)->s->hostname, node->mess.Host) ||
-                    strcmp(sport, node->mess.Port)) {
-                    (*worker)->s->index = 0;
-                    /* XXX: broken  ap_my_generation--; mark old generation that will recreate the process */
-                    continue; /* skip it */
-                }
+    if (index == NULL || id < 0 || id >= index->size)
+        return NULL;
+    worker = index->workers[id];
+    if (worker == NULL)
+        return NULL;
+    helper = (proxy_cluster_helper *) worker->context;
+    if (worker->s != stat || helper->index != id)
+        return NULL;
 
-                return *worker;
-            }
-        }
+    /* Check that the slot wasn't given to another node since the worker was created */
+    if (helper->generation != apr_atomic_read32(&node->generation)) {
+        worker->s->index = 0;
+        /* XXX: broken  ap_my_generation--; mark old generation that will recreate the process */
+        return NULL;
     }
-    return NULL;
+    return worker;
 }
 
 /*
@@ -643,7 +858,7 @@ static int remove_workers_node(nodeinfo_t *node, proxy_server_conf *conf, apr_po
     proxy_worker *worker;
     pptr = pptr + node->offset;
 
-    worker = get_worker_from_id_stat(conf, node->mess.id, (proxy_worker_shared *) pptr, node);
+    worker = get_worker_from_id_stat(server, node->mess.id, (proxy_worker_shared *) pptr, node);
     if (!worker) {
         /* XXX: Another process may use it, can't do: node_storage->remove_node(node); */
         return 0; /* Done */
@@ -658,7 +873,7 @@ static int remove_workers_node(nodeinfo_t *node, proxy_server_conf *conf, apr_po
 
     helper = (proxy_cluster_helper *) worker->context;
     if (helper) {
-        i = helper->count_active;
+        i = apr_atomic_read32(&helper->count_active);
     }
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
              "remove_workers_node (helper) count_active: %d JVMRoute: %s", i, node->mess.JVMRoute);
@@ -670,12 +885,13 @@ static int remove_workers_node(nodeinfo_t *node, proxy_server_conf *conf, apr_po
 
         /* Here that is tricky the worker needs shared memory but we don't and CONFIG will reset it */
         helper->index = 0; /* mark it removed */
+        set_worker_index(server, node->mess.id, NULL);
         worker->s = helper->shared;
         memcpy(worker->s, stat, sizeof(proxy_worker_shared));
 
         return (0);
     } else {
-        node->mess.lastcleantry = apr_time_now();
+        node_storage->update_node_mess(node, 0, apr_time_now());
         return (1); /* We should retry later */
     }
 }
@@ -683,21 +899,25 @@ static int remove_workers_node(nodeinfo_t *node, proxy_server_conf *conf, apr_po
  * Create/Remove workers corresponding to updated nodes.
  * NOTE: It is called from proxy_cluster_watchdog_func and other locations
  *       It shouldn't call worker_nodes_are_updated() because there may be several VirtualHosts.
+ *       With check the requests only compare the version of the node table
+ *       with the one of the VirtualHost (its own proxy_cluster_server_conf)
+ *       without locking, the first thread seeing a new version creates the
+ *       workers of that VirtualHost.
  */
 static void update_workers_node(proxy_server_conf *conf, apr_pool_t *pool, server_rec *server, int check)
 {
     int *id, size, i;
-    unsigned int last;
+    proxy_cluster_server_conf *cconf = ap_get_module_config(server->module_config, &proxy_cluster_module);
+    apr_uint32_t version = (apr_uint32_t) node_storage->get_version_node() + 1;
 
     /* Check if we have to do something */
+    if (check && apr_atomic_read32(&cconf->workers_version) == version)
+        return;
     apr_thread_mutex_lock(lock);
-    if (check) { 
-        last = node_storage->worker_nodes_need_update(main_server, pool);
-        /* nodes_need_update will return 1 if last_updated is zero: first time we are called */
-        if (last == 0) {
-            apr_thread_mutex_unlock(lock);
-            return;
-        }
+    if (check && apr_atomic_read32(&cconf->workers_version) == version) {
+        /* another thread did it */
+        apr_thread_mutex_unlock(lock);
+        return;
     }
 
     /* read the ident of the nodes */
@@ -724,6 +944,8 @@ static void update_workers_node(proxy_server_conf *conf, apr_pool_t *pool, serve
         add_balancers_workers_for_server(ou, pool, server);
     } 
 
+    /* version was read before the scan: a change during the scan is seen by the next request */
+    apr_atomic_set32(&cconf->workers_version, version);
     apr_thread_mutex_unlock(lock);
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
              "update_workers_node done");
@@ -1046,30 +1268,230 @@ static apr_status_t proxy_cluster_try_pingpong(request_rec *r, proxy_worker *wor
     return status;
 }
 
-/* read the node and check that it corresponds to the worker */
-static apr_status_t read_node_worker(int id, nodeinfo_t **node, proxy_worker *worker)
+/*
+ * read the hot part of the node and check that it corresponds to the worker:
+ * the slot of the node has the generation it had when the worker was created.
+ */
+static apr_status_t read_node_hot_worker(int id, nodehot_t **hot, proxy_worker *worker)
 {
-    char sport[7];
-    apr_status_t status = node_storage->read_node(id, node);
+    proxy_cluster_helper *helper = (proxy_cluster_helper *) worker->context;
+    apr_status_t status = node_storage->read_node_hot(id, hot);
     if (status != APR_SUCCESS)
         return status;
-    apr_snprintf(sport, sizeof(sport), "%d", worker->s->port);
-    if (strcmp(worker->s->scheme, (* node)->mess.Type) ||
-        compare_hostname(worker->s->hostname, (* node)->mess.Host) ||
-        strcmp(sport, (* node)->mess.Port)) {
-        /* for some reasons it is not the right node */
+    if (!helper || helper->index != id || helper->generation != apr_atomic_read32(&(*hot)->generation)) {
+        /* the slot is now used by another node */
         return APR_NOTFOUND;
     }
     return APR_SUCCESS;
 }
 
+/* cping/cpong of an idle node, prepared and published by the watchdog */
+struct proxy_cluster_probe {
+    int id;                  /* id of the node */
+    nodeinfo_t *node;
+    proxy_worker *worker;
+    proxy_server_conf *conf;
+    server_rec *server;      /* server of the conf of the worker */
+    char *url;
+    apr_pool_t *pool;        /* pool of the probe: the threads can't share one */
+    apr_status_t rv;         /* result of the cping/cpong */
+};
+typedef struct proxy_cluster_probe proxy_cluster_probe;
+
+/* the probes of one watchdog pass, the threads take the next one to run */
+struct proxy_cluster_probes {
+    proxy_cluster_probe *probe;
+    int nprobe;
+    apr_uint32_t next;       /* apr_atomic */
+};
+typedef struct proxy_cluster_probes proxy_cluster_probes;
+
+/* run the probes until there isn't anything left to do */
+static void run_probes(proxy_cluster_probes *probes)
+{
+    apr_uint32_t i;
+    while ((i = apr_atomic_inc32(&probes->next)) < (apr_uint32_t) probes->nprobe) {
+        proxy_cluster_probe *probe = &probes->probe[i];
+        apr_pool_t *rrp = probe->pool;
+        server_rec *server = probe->server;
+        request_rec *rnew;
+
+        /* create a dummy request and do a ping */
+        rnew = apr_pcalloc(rrp, sizeof(request_rec));
+        rnew->pool = rrp;
+        /* we need only those ones */
+        rnew->server = server;
+        rnew->connection = apr_pcalloc(rrp, sizeof(conn_rec));
+        rnew->connection->log_id = "-";
+        rnew->connection->conn_config = ap_create_conn_config(rrp);
+        rnew->log_id = "-";
+        rnew->useragent_addr = apr_pcalloc(rrp, sizeof(apr_sockaddr_t));
+        rnew->per_dir_config = server->lookup_defaults;
+        rnew->notes = apr_table_make(rnew->pool, 1);
+        rnew->method = "PING";
+        rnew->uri = "/";
+        rnew->headers_in = apr_table_make(rnew->pool, 1);
+        probe->rv = proxy_cluster_try_pingpong(rnew, probe->worker, probe->url, probe->conf,
+                                               probe->node->mess.ping, probe->node->mess.timeout);
+    }
+}
+static void * APR_THREAD_FUNC probe_thread_func(apr_thread_t *thd, void *data)
+{
+    run_probes((proxy_cluster_probes *) data);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+/*
+ * Run the probes concurrently: a hung node only delays its own result,
+ * the pass takes about the longest ping timeout instead of their sum.
+ */
+static void run_probes_concurrently(proxy_cluster_probes *probes, apr_pool_t *pool, server_rec *server)
+{
+    apr_thread_t **threads;
+    int nthread, i;
+
+    nthread = probes->nprobe < MAX_PROBE_THREADS ? probes->nprobe : MAX_PROBE_THREADS;
+    threads = apr_pcalloc(pool, sizeof(apr_thread_t *) * nthread);
+    /* the watchdog thread is one of them */
+    for (i = 1; i < nthread; i++) {
+        apr_status_t rv = apr_thread_create(&threads[i], NULL, probe_thread_func, probes, pool);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, server,
+                         "run_probes_concurrently: apr_thread_create failed");
+            threads[i] = NULL;
+            break;
+        }
+    }
+    run_probes(probes);
+    for (i = 1; i < nthread && threads[i]; i++) {
+        apr_status_t trv;
+        apr_thread_join(&trv, threads[i]);
+    }
+}
+
+/* the node is ejected by the outlier detection */
+static int node_is_ejected(nodehot_t *hot)
+{
+    return outlier_detection && (apr_uint32_t) apr_time_sec(apr_time_now()) < apr_atomic_read32(&hot->ejected_until);
+}
+
+/*
+ * lbfactor of the worker during the slow start of its node: it ramps from
+ * SLOWSTART_MIN % to the full lbfactor in slow_start seconds after the node
+ * joined, came back from error or was readmitted by the outlier detection.
+ */
+static int effective_lbfactor(proxy_worker *worker, nodehot_t *hot)
+{
+    int lbfactor = worker->s->lbfactor;
+    int minfactor;
+    apr_uint32_t begin, now;
+
+    if (slow_start <= 0 || lbfactor <= 0)
+        return lbfactor;
+    begin = apr_atomic_read32(&hot->slowstart);
+    if (apr_atomic_read32(&hot->ejected_until) > begin)
+        begin = apr_atomic_read32(&hot->ejected_until);
+    now = (apr_uint32_t) apr_time_sec(apr_time_now());
+    if (now >= begin + slow_start)
+        return lbfactor;
+    minfactor = (lbfactor * SLOWSTART_MIN) / 100;
+    if (minfactor < 1)
+        minfactor = 1;
+    lbfactor = (int) (((apr_int64_t) lbfactor * (now > begin ? now - begin : 0)) / slow_start);
+    return lbfactor < minfactor ? minfactor : lbfactor;
+}
+
+/* add a sample to a moving average shared by all the children */
+static void update_ewma(apr_uint32_t *ewma, apr_uint32_t sample)
+{
+    apr_uint32_t old, new;
+    do {
+        old = apr_atomic_read32(ewma);
+        new = (apr_uint32_t) ((apr_int32_t) old + (((apr_int32_t) sample - (apr_int32_t) old) / (1 << EWMA_SHIFT)));
+    } while (apr_atomic_cas32(ewma, new, old) != old);
+}
+
+/*
+ * Passive outlier detection (run by the maintenance leader): compare the
+ * moving averages of the nodes of each balancer. A node with too many 5xx
+ * or much slower than the other nodes is ejected for outlier_ejection_time
+ * doubled for each consecutive ejection. At most half of the nodes of a
+ * balancer are ejected.
+ */
+static void detect_outliers(apr_pool_t *pool, server_rec *server)
+{
+    int *id, size, i, j;
+    nodeinfo_t **nodes;
+    nodehot_t **hots;
+    apr_uint32_t now = (apr_uint32_t) apr_time_sec(apr_time_now());
+
+    size = node_storage->get_max_size_node();
+    if (size == 0)
+        return;
+    id = apr_pcalloc(pool, sizeof(int) * size);
+    size = node_storage->get_ids_used_node(id);
+    nodes = apr_pcalloc(pool, sizeof(nodeinfo_t *) * (size ? size : 1));
+    hots = apr_pcalloc(pool, sizeof(nodehot_t *) * (size ? size : 1));
+    for (i = 0; i < size; i++) {
+        if (node_storage->read_node(id[i], &nodes[i]) != APR_SUCCESS ||
+            nodes[i]->mess.remove ||
+            node_storage->read_node_hot(id[i], &hots[i]) != APR_SUCCESS) {
+            nodes[i] = NULL;
+            continue;
+        }
+        /* healthy long enough after the last ejection: forget the back-off */
+        if (hots[i]->ejections && now >= hots[i]->ejected_until &&
+            now - hots[i]->ejected_until >= (apr_uint32_t) (outlier_ejection_time << OUTLIER_BACKOFF(hots[i])))
+            hots[i]->ejections = 0;
+    }
+
+    for (i = 0; i < size; i++) {
+        apr_uint64_t sum = 0;
+        int others = 0, total = 0, ejected = 0;
+        apr_uint32_t latency, errors;
+        if (nodes[i] == NULL || now < hots[i]->ejected_until)
+            continue;
+        for (j = 0; j < size; j++) {
+            if (nodes[j] == NULL || strcmp(nodes[i]->mess.balancer, nodes[j]->mess.balancer))
+                continue;
+            total++;
+            if (now < hots[j]->ejected_until) {
+                ejected++;
+            } else if (j != i && hots[j]->ewma_latency) {
+                sum += hots[j]->ewma_latency;
+                others++;
+            }
+        }
+        if ((ejected + 1) * 2 > total)
+            continue; /* keep at least half of the nodes */
+
+        latency = apr_atomic_read32(&hots[i]->ewma_latency);
+        errors = apr_atomic_read32(&hots[i]->ewma_errors);
+        if (errors > OUTLIER_ERRORS ||
+            (others && latency > OUTLIER_MIN_LATENCY && latency > OUTLIER_LATENCY_FACTOR * (sum / others))) {
+            int duration = outlier_ejection_time << OUTLIER_BACKOFF(hots[i]);
+            ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, server,
+                         "proxy: CLUSTER: ejecting node %s for %d seconds (latency %u us, %u%% errors)",
+                         nodes[i]->mess.JVMRoute, duration, latency, (errors * 100) >> 16);
+            hots[i]->ejections++;
+            /* start again from scratch when it comes back */
+            apr_atomic_set32(&hots[i]->ewma_latency, 0);
+            apr_atomic_set32(&hots[i]->ewma_errors, 0);
+            apr_atomic_set32(&hots[i]->ejected_until, now + duration);
+        }
+    }
+}
+
 /*
  * update the lbfactor of each node if needed,
+ * the idle nodes are probed once (for all the VirtualHosts) and concurrently.
  */
-static void update_workers_lbstatus(proxy_server_conf *conf, apr_pool_t *pool, server_rec *server)
+static void update_workers_lbstatus(apr_pool_t *pool, server_rec *server)
 {
     int *id, size, i;
     apr_time_t now;
+    proxy_cluster_probes probes;
 
     now = apr_time_now();
 
@@ -1079,15 +1501,21 @@ static void update_workers_lbstatus(proxy_server_conf *conf, apr_pool_t *pool, s
         return;
     id = apr_pcalloc(pool, sizeof(int) * size);
     size = node_storage->get_ids_used_node(id);
+    probes.probe = apr_pcalloc(pool, sizeof(proxy_cluster_probe) * (size ? size : 1));
+    probes.nprobe = 0;
+    probes.next = 0;
 
     /* update lbstatus if needed */
     for (i=0; i<size; i++) {
         nodeinfo_t *ou;
+        nodehot_t *hot;
         if (node_storage->read_node(id[i], &ou) != APR_SUCCESS)
             continue;
         if (ou->mess.remove)
             continue;
-        if (ou->mess.updatetimelb < (now - lbstatus_recalc_time)) {
+        if (node_storage->read_node_hot(id[i], &hot) != APR_SUCCESS)
+            continue;
+        if (hot->updatetimelb < (now - lbstatus_recalc_time)) {
             /* The lbstatus needs to be updated */
             int elected, oldelected;
             proxy_worker_shared *stat;
@@ -1095,84 +1523,80 @@ static void update_workers_lbstatus(proxy_server_conf *conf, apr_pool_t *pool, s
             ptr = ptr + ou->offset;
             stat = (proxy_worker_shared *) ptr;
             elected = stat->elected;
-            oldelected = ou->mess.oldelected;
-            ou->mess.updatetimelb = now;
-            ou->mess.oldelected = elected;
+            oldelected = hot->oldelected;
+            hot->updatetimelb = now;
+            hot->oldelected = elected;
             if (stat->lbfactor > 0)
                 stat->lbstatus = ((elected - oldelected) * 1000) / stat->lbfactor;
             if (elected == oldelected) {
                 /* lbstatus_recalc_time without changes: test for broken nodes */
-                /* first get the worker, create a dummy request and do a ping  */
+                /* first get the worker (in any VirtualHost) and prepare the ping */
                 char sport[7];
-                char *url;
-                apr_status_t rv;
-                apr_pool_t *rrp;
-                request_rec *rnew;
-                proxy_worker *worker;
+                proxy_worker *worker = NULL;
+                proxy_cluster_probe *probe;
+                server_rec *s = server;
+                proxy_server_conf *conf = NULL;
                 apr_thread_mutex_lock(lock);
-                worker = get_worker_from_id_stat(conf, id[i], stat, ou);
+                while (s && worker == NULL) {
+                    conf = (proxy_server_conf *) ap_get_module_config(s->module_config, &proxy_module);
+                    worker = get_worker_from_id_stat(s, id[i], stat, ou);
+                    if (worker == NULL)
+                        s = s->next;
+                }
                 apr_thread_mutex_unlock(lock);
 
                 if (worker == NULL)
-                    continue; /* skip it */
+                    continue; /* skip it (or the worker doesn't correspond to the node) */
                 apr_snprintf(sport, sizeof(sport), "%d", worker->s->port);
 
-                if (strcmp(worker->s->scheme, ou->mess.Type) ||
-                    compare_hostname(worker->s->hostname, ou->mess.Host) ||
-                    strcmp(sport, ou->mess.Port)) {
-                    /* the worker doesn't correspond to the node */
-                    worker->s->index = 0;
-                    /* XXX: broken ap_my_generation--; mark old generation that will recreate the process */ 
-                    continue; /* skip it */
-                }
-
+                probe = &probes.probe[probes.nprobe++];
+                probe->id = id[i];
+                probe->node = ou;
+                probe->worker = worker;
+                probe->conf = conf;
+                probe->server = s;
                 if (strchr(worker->s->hostname, ':') != NULL)
-                    url = apr_pstrcat(pool, worker->s->scheme, "://[", worker->s->hostname, "]:", sport, "/", NULL);
+                    probe->url = apr_pstrcat(pool, worker->s->scheme, "://[", worker->s->hostname, "]:", sport, "/", NULL);
                 else
-                    url = apr_pstrcat(pool, worker->s->scheme, "://", worker->s->hostname,  ":", sport, "/", NULL);
-
-                apr_pool_create(&rrp, pool);
-                apr_pool_tag(rrp, "subrequest");
-                rnew = apr_pcalloc(rrp, sizeof(request_rec));
-                rnew->pool = rrp;
-                /* we need only those ones */
-                rnew->server = server;
-                rnew->connection = apr_pcalloc(rrp, sizeof(conn_rec));
-                rnew->connection->log_id = "-";
-                rnew->connection->conn_config = ap_create_conn_config(rrp);
-                rnew->log_id = "-";
-                rnew->useragent_addr = apr_pcalloc(rrp, sizeof(apr_sockaddr_t));
-                rnew->per_dir_config = server->lookup_defaults;
-                rnew->notes = apr_table_make(rnew->pool, 1);
-                rnew->method = "PING";
-                rnew->uri = "/";
-                rnew->headers_in = apr_table_make(rnew->pool, 1);
-                rv = proxy_cluster_try_pingpong(rnew, worker, url, conf, ou->mess.ping, ou->mess.timeout);
-
-                if (read_node_worker(id[i], &ou, worker) != APR_SUCCESS)
-                    continue;
-
-                if (rv != APR_SUCCESS) {
-                    /* We can't reach the node */
-                    worker->s->status |= PROXY_WORKER_IN_ERROR;
-                    ou->mess.num_failure_idle++;
-                    if (ou->mess.num_failure_idle > 60) {
-                        /* Failing for 5 minutes: time to mark it removed */
-                        ou->mess.remove = 1;
-                        ou->updatetime = now;
-                    } 
-                } else
-                    ou->mess.num_failure_idle = 0;
+                    probe->url = apr_pstrcat(pool, worker->s->scheme, "://", worker->s->hostname,  ":", sport, "/", NULL);
+                apr_pool_create(&probe->pool, pool);
+                apr_pool_tag(probe->pool, "subrequest");
             } else
-                ou->mess.num_failure_idle = 0;
+                hot->num_failure_idle = 0;
         } 
     } 
+    if (probes.nprobe == 0)
+        return;
+
+    run_probes_concurrently(&probes, pool, server);
+
+    /* publish the results in the shared memory */
+    for (i = 0; i < probes.nprobe; i++) {
+        proxy_cluster_probe *probe = &probes.probe[i];
+        proxy_worker *worker = probe->worker;
+        nodeinfo_t *ou = probe->node;
+        nodehot_t *hot;
+
+        if (read_node_hot_worker(probe->id, &hot, worker) != APR_SUCCESS)
+            continue;
+
+        if (probe->rv != APR_SUCCESS) {
+            /* We can't reach the node */
+            worker->s->status |= PROXY_WORKER_IN_ERROR;
+            hot->num_failure_idle++;
+            if (hot->num_failure_idle > 60) {
+                /* Failing for 5 minutes: time to mark it removed */
+                node_storage->update_node_mess(ou, 1, 0);
+            } 
+        } else
+            hot->num_failure_idle = 0;
+    }
 }
 
 /*
  * remove the sessionids that have timeout
  */
-static void remove_timeout_sessionid(proxy_server_conf *conf, apr_pool_t *pool, server_rec *server)
+static void remove_timeout_sessionid(apr_pool_t *pool)
 {
     int *id, size, i;
     apr_time_t now;
@@ -1226,114 +1650,180 @@ static void remove_timeout_domain(apr_pool_t *pool)
     } 
 }
 
-/**
- * Retrieve the parameter with the given name
- * Something like 'JSESSIONID=12345...N'
- *
- * TODO: Should use the mod_proxy_balancer one
+/*
+ * Session ids of the request: the Cookie header and the path parameters
+ * are split once for all the sticky names of the MC balancers, in
+ * proxy_cluster_trans(), and the values are kept in the notes of the
+ * request for the later hooks.
  */
-static char *get_path_param(apr_pool_t *pool, char *url,
-                            const char *name)
+struct proxy_session_params
 {
-    char *path = NULL;
-    char *pathdelims = ";?&";
+	apr_array_header_t *names; /* sticky names of the MC balancers */
+	apr_hash_t *cookies;       /* name -> value from the Cookie header */
+	apr_hash_t *params;        /* name -> value from the path parameters of uri */
+	const char *uri;
+};
+typedef struct proxy_session_params proxy_session_params;
 
-    for (path = strstr(url, name); path; path = strstr(path + 1, name)) {
+/* is the name (len bytes) one of the names we look for */
+static const char *session_name_lookup(apr_array_header_t *names, const char *name, apr_size_t len)
+{
+    int i;
+    const char **elts = (const char **) names->elts;
+    for (i = 0; i < names->nelts; i++) {
+        if (strncmp(elts[i], name, len) == 0 && elts[i][len] == '\0')
+            return elts[i];
+    }
+    return NULL;
+}
 
-        /* Must be following a ';' and followed by '=' to be the correct session id name */
-        if (*(path - 1) == ';') {
-            path += strlen(name);
-            if (*path == '=') {
-                /*
-                 * Session path was found, get its value
-                 */
-                ++path;
-                if (*path) {
-                    char *q;
-                    path = apr_strtok(apr_pstrdup(pool, path), pathdelims, &q);
-                    return path;
-                }
+/*
+ * Split a Cookie (or Set-Cookie) header in one pass and store the values
+ * of the given names, the first occurrence wins. strcspn() looks for the
+ * delimiters: the C library scans long headers word or vector wise.
+ */
+static void parse_cookies(apr_pool_t *pool, const char *cookies, apr_array_header_t *names, apr_hash_t *values)
+{
+    const char *start = cookies;
+
+    while (*start) {
+        const char *end, *eq, *name, *value;
+        apr_size_t len;
+
+        while (*start == ';' || *start == ',' || isspace(*start))
+            start++;
+        if (!*start)
+            break;
+        len = strcspn(start, ";,");
+        end = start + len;
+        eq = memchr(start, '=', len);
+        if (eq == NULL || eq + 1 == end) {
+            start = end;
+            continue;
+        }
+        /* the name may be followed by spaces */
+        for (len = eq - start; len > 0 && isspace(start[len - 1]); len--)
+            ;
+        name = session_name_lookup(names, start, len);
+        if (name && apr_hash_get(values, name, APR_HASH_KEY_STRING) == NULL) {
+            value = eq + 1;
+            len = end - value;
+            /* remove " from version1 cookies */
+            if (len >= 2 && value[0] == '"' && value[len - 1] == '"') {
+                value++;
+                len -= 2;
             }
+            apr_hash_set(values, name, APR_HASH_KEY_STRING, apr_pstrndup(pool, value, len));
         }
+        start = end;
     }
-    return NULL;
 }
 
 /*
- * Read the cookie corresponding to name
+ * Read the path parameters of the uri, something like ';JSESSIONID=12345...N',
+ * a value ends with ';', '?' or '&'.
+ */
+static void parse_path_params(apr_pool_t *pool, const char *uri, apr_array_header_t *names, apr_hash_t *values)
+{
+    const char *param;
+
+    for (param = strchr(uri, ';'); param; param = strchr(param, ';')) {
+        const char *eq, *name;
+        apr_size_t len;
+
+        param++;
+        len = strcspn(param, ";?&");
+        eq = memchr(param, '=', len);
+        if (eq && eq + 1 < param + len) {
+            name = session_name_lookup(names, param, eq - param);
+            if (name && apr_hash_get(values, name, APR_HASH_KEY_STRING) == NULL)
+                apr_hash_set(values, name, APR_HASH_KEY_STRING, apr_pstrndup(pool, eq + 1, param + len - eq - 1));
+        }
+        param += len;
+    }
+}
+
+/*
+ * Get the session parameters of the request, split them the first time
+ * and again for the path if uri isn't the one used the last time.
+ */
+static proxy_session_params *get_session_params(request_rec *r, const char *uri)
+{
+    proxy_session_params *params = (proxy_session_params *) apr_table_get(r->notes, "cluster-session-params");
+
+    if (params == NULL) {
+        proxy_server_conf *conf = (proxy_server_conf *) ap_get_module_config(r->server->module_config, &proxy_module);
+        const char *cookies = apr_table_get(r->headers_in, "Cookie");
+        char *ptr = conf->balancers->elts;
+        int sizeb = conf->balancers->elt_size;
+        int i;
+
+        params = apr_pcalloc(r->pool, sizeof(proxy_session_params));
+        params->names = apr_array_make(r->pool, 4, sizeof(const char *));
+        for (i = 0; i < conf->balancers->nelts; i++, ptr=ptr+sizeb) {
+            proxy_balancer *balancer = (proxy_balancer *) ptr;
+            if (balancer->s->sticky[0] == '\0' || balancer->s->sticky_path[0] == '\0')
+                continue;
+            if (strncmp(balancer->s->lbpname, "MC", 2))
+                continue;
+            if (!session_name_lookup(params->names, balancer->s->sticky, strlen(balancer->s->sticky)))
+                *(const char **) apr_array_push(params->names) = apr_pstrdup(r->pool, balancer->s->sticky);
+            if (!session_name_lookup(params->names, balancer->s->sticky_path, strlen(balancer->s->sticky_path)))
+                *(const char **) apr_array_push(params->names) = apr_pstrdup(r->pool, balancer->s->sticky_path);
+        }
+        params->cookies = apr_hash_make(r->pool);
+        if (cookies && params->names->nelts)
+            parse_cookies(r->pool, cookies, params->names, params->cookies);
+        apr_table_setn(r->notes, "cluster-session-params", (char *) params);
+    }
+    if (params->uri == NULL || strcmp(params->uri, uri)) {
+        params->uri = apr_pstrdup(r->pool, uri);
+        params->params = apr_hash_make(r->pool);
+        if (params->names->nelts)
+            parse_path_params(r->pool, uri, params->names, params->params);
+    }
+    return params;
+}
+
+/*
+ * Read the cookie corresponding to name in the response
  * @param r request.
  * @param name name of the cookie
- * @param in tells if cookie should read from the request or the response
  * @return the value of the cookie
  */
-static char *get_cookie_param(request_rec *r, const char *name, int in)
+static char *get_response_cookie(request_rec *r, const char *name)
 {
-    const char *cookies;
-    const char *start_cookie;
+    const char *cookies = apr_table_get(r->headers_out, "Set-Cookie");
+    apr_array_header_t *names;
+    apr_hash_t *values;
 
-    if (in)
-        cookies = apr_table_get(r->headers_in, "Cookie");
-    else
-        cookies = apr_table_get(r->headers_out, "Set-Cookie");
-    if (cookies) {
-        for (start_cookie = ap_strstr_c(cookies, name); start_cookie;
-             start_cookie = ap_strstr_c(start_cookie + 1, name)) {
-            if (start_cookie == cookies ||
-                start_cookie[-1] == ';' ||
-                start_cookie[-1] == ',' ||
-                isspace(start_cookie[-1])) {
-
-                start_cookie += strlen(name);
-                while(*start_cookie && isspace(*start_cookie))
-                    ++start_cookie;
-                if (*start_cookie == '=' && start_cookie[1]) {
-                    /*
-                     * Session cookie was found, get it's value
-                     */
-                    char *end_cookie, *cookie;
-                    ++start_cookie;
-                    cookie = apr_pstrdup(r->pool, start_cookie);
-                    if ((end_cookie = strchr(cookie, ';')) != NULL)
-                        *end_cookie = '\0';
-                    if((end_cookie = strchr(cookie, ',')) != NULL)
-                        *end_cookie = '\0';
-                    /* remove " from version1 cookies */
-                    if (*cookie == '\"' && *(cookie+strlen(cookie)-1) == '\"') {
-                        ++cookie;
-                        *(cookie+strlen(cookie)-1) = '\0';
-                        cookie = apr_pstrdup(r->pool, cookie);
-                    }
-                    return cookie;
-                }
-            }
-        }
-    }
-    return NULL;
+    if (cookies == NULL)
+        return NULL;
+    names = apr_array_make(r->pool, 1, sizeof(const char *));
+    *(const char **) apr_array_push(names) = name;
+    values = apr_hash_make(r->pool);
+    parse_cookies(r->pool, cookies, names, values);
+    return apr_hash_get(values, name, APR_HASH_KEY_STRING);
 }
 
 /**
  * Check that the request has a sessionid with a route
  * @param r the request_rec.
- * @param stickyval the cookie or/and parameter name.
+ * @param sticky the cookie name.
+ * @param sticky_path the parameter name.
  * @param uri part of the URL to for the session parameter.
  * @param sticky_used the string that was used to find the route
  */
-static char *cluster_get_sessionid(request_rec *r, const char *stickyval, char *uri, char **sticky_used)
+static char *cluster_get_sessionid(request_rec *r, const char *sticky, const char *sticky_path,
+                                   const char *uri, const char **sticky_used)
 {
-    char *sticky, *sticky_path;
-    char *path;
+    proxy_session_params *params = get_session_params(r, uri);
     char *route;
 
-    /* for 2.2.x the sticky parameter may contain 2 values */
-    sticky = sticky_path = apr_pstrdup(r->pool, stickyval);
-    if ((path = strchr(sticky, '|'))) {
-        *path++ = '\0';
-         sticky_path = path;
-    }
     *sticky_used = sticky_path;
-    route = get_cookie_param(r, sticky, 1);
+    route = apr_hash_get(params->cookies, sticky, APR_HASH_KEY_STRING);
     if (!route) {
-        route = get_path_param(r->pool, uri, sticky_path);
+        route = apr_hash_get(params->params, sticky_path, APR_HASH_KEY_STRING);
         *sticky_used = sticky;
     }
     return route;
@@ -1351,8 +1841,7 @@ static int hassession_byname(request_rec *r, int nodeid, const char *route)
     proxy_balancer *balancer = NULL;
     char *sessionid;
     char *uri;
-    char *sticky_used;
-    char *sticky;
+    const char *sticky_used;
     int i;
     proxy_server_conf *conf;
     nodeinfo_t *node;
@@ -1381,10 +1870,6 @@ static int hassession_byname(request_rec *r, int nodeid, const char *route)
     if (balancer == NULL)
         return 0;
 
-    sticky = apr_psprintf(r->pool, "%s|%s", balancer->s->sticky, balancer->s->sticky_path);
-    if (sticky == NULL)
-        return 0;
-
     if (r->filename)
         uri = r->filename + 6;
     else {
@@ -1392,7 +1877,7 @@ static int hassession_byname(request_rec *r, int nodeid, const char *route)
         uri = r->unparsed_uri;
     }
 
-    sessionid = cluster_get_sessionid(r, sticky, uri, &sticky_used);
+    sessionid = cluster_get_sessionid(r, balancer->s->sticky, balancer->s->sticky_path, uri, &sticky_used);
     if (sessionid) {
 #if HAVE_CLUSTER_EX_DEBUG
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
@@ -1405,108 +1890,112 @@ static int hassession_byname(request_rec *r, int nodeid, const char *route)
 
 
 /* Read the virtual host table from shared memory */
-static proxy_vhost_table *read_vhost_table(request_rec *r)
+static void read_vhost_table(apr_pool_t *pool, proxy_vhost_table *vhost_table)
 {
     int i;
     int size;
-    proxy_vhost_table *vhost_table = apr_palloc(r->pool, sizeof(proxy_vhost_table));
     size = host_storage->get_max_size_host();
     if (size == 0) {
         vhost_table->sizevhost = 0;
         vhost_table->vhosts = NULL;
         vhost_table->vhost_info = NULL;
-        return vhost_table;
+        return;
     }
-
-    vhost_table->vhosts =  apr_palloc(r->pool, sizeof(int) * host_storage->get_max_size_host());
+    vhost_table->vhosts =  apr_palloc(pool, sizeof(int) * size);
     vhost_table->sizevhost = host_storage->get_ids_used_host(vhost_table->vhosts);
-    vhost_table->vhost_info = apr_palloc(r->pool, sizeof(hostinfo_t) * vhost_table->sizevhost);
+    vhost_table->vhost_info = apr_palloc(pool, sizeof(hostinfo_t) * vhost_table->sizevhost);
     for (i = 0; i < vhost_table->sizevhost; i++) {
         hostinfo_t* h;
         int host_index = vhost_table->vhosts[i];
-        host_storage->read_host(host_index, &h);
-        vhost_table->vhost_info[i] = *h;
+        if (host_storage->read_host(host_index, &h) == APR_SUCCESS)
+            vhost_table->vhost_info[i] = *h;
+        else
+            memset(&vhost_table->vhost_info[i], 0, sizeof(hostinfo_t));
     }
-    return vhost_table;
 }
 
 /* Read the context table from shared memory */
-static proxy_context_table *read_context_table(request_rec *r)
+static void read_context_table(apr_pool_t *pool, proxy_context_table *context_table)
 {
     int i;
     int size;
-    proxy_context_table *context_table = apr_palloc(r->pool, sizeof(proxy_context_table));
     size = context_storage->get_max_size_context();
-    if (size == 0) { 
+    if (size == 0) {
         context_table->sizecontext = 0;
         context_table->contexts = NULL;
         context_table->context_info = NULL;
-        return context_table;
+        context_table->index = NULL;
+        return;
     }
-    context_table->contexts =  apr_palloc(r->pool, sizeof(int) * size);
+    context_table->contexts =  apr_palloc(pool, sizeof(int) * size);
     context_table->sizecontext = context_storage->get_ids_used_context(context_table->contexts);
-    context_table->context_info = apr_palloc(r->pool, sizeof(contextinfo_t) * context_table->sizecontext);
+    context_table->context_info = apr_palloc(pool, sizeof(contextinfo_t) * context_table->sizecontext);
     for (i = 0; i < context_table->sizecontext; i++) {
         contextinfo_t* h;
         int context_index = context_table->contexts[i];
-        context_storage->read_context(context_index, &h);
-        context_table->context_info[i] = *h;
+        if (context_storage->read_context(context_index, &h) == APR_SUCCESS)
+            context_table->context_info[i] = *h;
+        else
+            memset(&context_table->context_info[i], 0, sizeof(contextinfo_t));
     }
-    return context_table;
+    context_table->index = NULL;
 }
 
 /* Read the balancer table from shared memory */
-static proxy_balancer_table *read_balancer_table(request_rec *r)
+static void read_balancer_table(apr_pool_t *pool, proxy_balancer_table *balancer_table)
 {
     int i;
     int size;
-    proxy_balancer_table *balancer_table = apr_palloc(r->pool, sizeof(proxy_balancer_table));
     size = balancer_storage->get_max_size_balancer();
-    if (size == 0) { 
+    if (size == 0) {
         balancer_table->sizebalancer = 0;
         balancer_table->balancers = NULL;
         balancer_table->balancer_info = NULL;
-        return balancer_table;
+        return;
     }
-    balancer_table->balancers =  apr_palloc(r->pool, sizeof(int) * size);
+    balancer_table->balancers =  apr_palloc(pool, sizeof(int) * size);
     balancer_table->sizebalancer = balancer_storage->get_ids_used_balancer(balancer_table->balancers);
-    balancer_table->balancer_info = apr_palloc(r->pool, sizeof(balancerinfo_t) * balancer_table->sizebalancer);
+    balancer_table->balancer_info = apr_palloc(pool, sizeof(balancerinfo_t) * balancer_table->sizebalancer);
     for (i = 0; i < balancer_table->sizebalancer; i++) {
         balancerinfo_t* h;
         int balancer_index = balancer_table->balancers[i];
-        balancer_storage->read_balancer(balancer_index, &h);
-        balancer_table->balancer_info[i] = *h;
+        if (balancer_storage->read_balancer(balancer_index, &h) == APR_SUCCESS)
+            balancer_table->balancer_info[i] = *h;
+        else
+            memset(&balancer_table->balancer_info[i], 0, sizeof(balancerinfo_t));
     }
-    return balancer_table;
 }
 
 /* Read the node table from shared memory */
-static proxy_node_table *read_node_table(request_rec *r)
+static void read_node_table(apr_pool_t *pool, proxy_node_table *node_table)
 {
-    int i;
+    int i, j;
     int size;
-    proxy_node_table *node_table =  apr_palloc(r->pool, sizeof(proxy_node_table));
     size = node_storage->get_max_size_node();
-    if (size == 0) { 
+    if (size == 0) {
         node_table->sizenode = 0;
         node_table->nodes = NULL;
         node_table->node_info = NULL;
-        return node_table;
+        return;
     }
-    node_table->nodes =  apr_palloc(r->pool, sizeof(int) * size);
-    node_table->sizenode = node_storage->get_ids_used_node(node_table->nodes);
-    node_table->node_info = apr_palloc(r->pool, sizeof(nodeinfo_t) * node_table->sizenode);
-    for (i = 0; i < node_table->sizenode; i++) {
+    node_table->nodes =  apr_palloc(pool, sizeof(int) * size);
+    size = node_storage->get_ids_used_node(node_table->nodes);
+    node_table->node_info = apr_palloc(pool, sizeof(nodemess_t) * size);
+    for (i = 0, j = 0; i < size; i++) {
         nodeinfo_t* h;
+        apr_uint32_t generation;
         int node_index = node_table->nodes[i];
-        node_storage->read_node(node_index, &h);
-        node_table->node_info[i] = *h;
+        /* a node that can't be read (freed meanwhile) isn't in the table */
+        if (node_storage->read_node_mess(node_index, &h, &node_table->node_info[j], &generation) != APR_SUCCESS)
+            continue;
+        node_table->nodes[j] = node_index;
+        j++;
     }
-    return node_table;
+    node_table->sizenode = j;
 }
 
 /* Read a node from the table using its it */
-static  nodeinfo_t* table_get_node(proxy_node_table *node_table, int id)
+static  nodemess_t* table_get_node(proxy_node_table *node_table, int id)
 {
     int i;
     for (i = 0; i < node_table->sizenode; i++) {
@@ -1516,6 +2005,273 @@ static  nodeinfo_t* table_get_node(proxy_node_table *node_table, int id)
     return NULL;
 }
 
+/* Add a context path to the trie */
+static void add_context_trie(apr_pool_t *pool, proxy_context_trie *trie, const char *path, int j)
+{
+    for (; *path; path++) {
+        proxy_context_trie *child;
+        for (child = trie->child; child; child = child->next) {
+            if (child->c == *path)
+                break;
+        }
+        if (child == NULL) {
+            child = apr_pcalloc(pool, sizeof(proxy_context_trie));
+            child->c = *path;
+            child->next = trie->child;
+            trie->child = child;
+        }
+        trie = child;
+    }
+    if (trie->contexts == NULL)
+        trie->contexts = apr_array_make(pool, 2, sizeof(int));
+    *(int *) apr_array_push(trie->contexts) = j;
+}
+
+/* Get (create) the bitset of contexts of key in the hash */
+static unsigned char *get_context_bitset(apr_pool_t *pool, apr_hash_t *hash, const char *key, int size)
+{
+    unsigned char *bitset = apr_hash_get(hash, key, APR_HASH_KEY_STRING);
+    if (bitset == NULL) {
+        bitset = apr_pcalloc(pool, CLUSTER_BITSET_SIZE(size));
+        apr_hash_set(hash, key, APR_HASH_KEY_STRING, bitset);
+    }
+    return bitset;
+}
+
+/*
+ * Compile the routing index of the snapshot: the trie of the contexts
+ * and the bitsets of the contexts per host alias and per balancer.
+ * find_node_context_host() then costs the length of the URI.
+ */
+static void build_context_index(apr_pool_t *pool, proxy_cluster_snapshot *snap)
+{
+    proxy_context_table *context_table = &snap->context_table;
+    proxy_vhost_table *vhost_table = &snap->vhost_table;
+    proxy_node_table *node_table = &snap->node_table;
+    int sizecontext = context_table->sizecontext;
+    proxy_context_index *index;
+    int i, j;
+
+    index = apr_pcalloc(pool, sizeof(proxy_context_index));
+    index->aliases = apr_hash_make(pool);
+    index->balancers = apr_hash_make(pool);
+    index->withnode = apr_pcalloc(pool, CLUSTER_BITSET_SIZE(sizecontext));
+    for (i = 0; i < node_table->sizenode; i++) {
+        if (node_table->nodes[i] > index->maxnode)
+            index->maxnode = node_table->nodes[i];
+    }
+
+    for (j = 0; j < sizecontext; j++) {
+        contextinfo_t *context = &context_table->context_info[j];
+        nodemess_t *node = table_get_node(node_table, context->node);
+        add_context_trie(pool, &index->root, context->context, j);
+        if (node != NULL) {
+            char *name = apr_pstrdup(pool, node->balancer);
+            ap_str_tolower(name);
+            CLUSTER_BITSET_SET(index->withnode, j);
+            CLUSTER_BITSET_SET(get_context_bitset(pool, index->balancers, name, sizecontext), j);
+        }
+    }
+
+    for (i = 0; i < vhost_table->sizevhost; i++) {
+        hostinfo_t *vhost = &vhost_table->vhost_info[i];
+        unsigned char *bitset = get_context_bitset(pool, index->aliases, vhost->host, sizecontext);
+        for (j = 0; j < sizecontext; j++) {
+            contextinfo_t *context = &context_table->context_info[j];
+            if (context->vhost == vhost->vhost && context->node == vhost->node)
+                CLUSTER_BITSET_SET(bitset, j);
+        }
+    }
+    context_table->index = index;
+}
+
+/* Read the 4 tables in the snapshot, MCMP can't modify them while we copy */
+static void read_snapshot_tables(apr_pool_t *pool, proxy_cluster_snapshot *snap)
+{
+    node_storage->lock_nodes_stats();
+    snap->version = node_storage->get_version_node();
+    read_vhost_table(pool, &snap->vhost_table);
+    read_context_table(pool, &snap->context_table);
+    read_balancer_table(pool, &snap->balancer_table);
+    read_node_table(pool, &snap->node_table);
+    node_storage->unlock_nodes_stats();
+    build_context_index(pool, snap);
+}
+
+/*
+ * Copy the 4 tables without the nodes lock: the copy may be torn if MCMP
+ * changed them meanwhile, it is only good if their generation was even
+ * (no writer) and didn't change during the copy.
+ * @return 1 if the copy is consistent.
+ */
+static int read_snapshot_tables_nolock(apr_pool_t *pool, proxy_cluster_snapshot *snap)
+{
+    apr_uint32_t generation = node_storage->get_tables_generation();
+
+    if (generation & 1)
+        return 0;
+    snap->version = node_storage->get_version_node();
+    read_vhost_table(pool, &snap->vhost_table);
+    read_context_table(pool, &snap->context_table);
+    read_balancer_table(pool, &snap->balancer_table);
+    read_node_table(pool, &snap->node_table);
+    if (node_storage->get_tables_generation() != generation)
+        return 0;
+    build_context_index(pool, snap);
+    return 1;
+}
+
+/*
+ * Build the next snapshot in its pool, without blocking the MCMP writers
+ * nor being blocked by them, but a burst of MCMP commands can't starve
+ * it: after a few tries the tables are read with the nodes lock.
+ */
+static proxy_cluster_snapshot *build_snapshot(apr_pool_t *pool)
+{
+    proxy_cluster_snapshot *snap;
+    int tries;
+
+    for (tries = 0; tries < SNAPSHOT_TRIES; tries++) {
+        snap = apr_palloc(pool, sizeof(proxy_cluster_snapshot));
+        snap->pool = pool;
+        snap->refcount = 1;
+        if (read_snapshot_tables_nolock(pool, snap))
+            return snap;
+        apr_pool_clear(pool);
+        apr_thread_yield();
+    }
+    snap = apr_palloc(pool, sizeof(proxy_cluster_snapshot));
+    snap->pool = pool;
+    snap->refcount = 1;
+    read_snapshot_tables(pool, snap);
+    return snap;
+}
+
+/*
+ * Pool with its own allocator: it is used under a lock of its own while
+ * the other threads allocate from the other pools (the snapshot is filled
+ * without snapshot_lock while the other threads use the current one).
+ */
+static apr_pool_t *create_private_pool(apr_pool_t *parent)
+{
+    apr_allocator_t *allocator;
+    apr_pool_t *pool;
+
+    if (apr_allocator_create(&allocator) != APR_SUCCESS)
+        return NULL;
+    if (apr_pool_create_ex(&pool, parent, NULL, allocator) != APR_SUCCESS) {
+        apr_allocator_destroy(allocator);
+        return NULL;
+    }
+    apr_allocator_owner_set(allocator, pool);
+    return pool;
+}
+
+/* Drop a reference to the snapshot, snapshot_lock must be held */
+static void release_snapshot(proxy_cluster_snapshot *snap)
+{
+    snap->refcount--;
+    if (snap->refcount == 0)
+        apr_pool_destroy(snap->pool);
+}
+
+static apr_status_t unpin_snapshot(void *data)
+{
+    apr_thread_mutex_lock(snapshot_lock);
+    release_snapshot((proxy_cluster_snapshot *) data);
+    apr_thread_mutex_unlock(snapshot_lock);
+    return APR_SUCCESS;
+}
+
+/*
+ * Pin the routing snapshot of the process for the request,
+ * (re)build it if the shared tables have changed: one thread builds the
+ * next one while the others keep using the current one, the new one is
+ * published by replacing current_snapshot.
+ */
+static proxy_cluster_snapshot *pin_snapshot(request_rec *r)
+{
+    proxy_cluster_snapshot *snap = NULL;
+    unsigned int version = node_storage->get_version_node();
+    apr_pool_t *pool = NULL;
+
+    if (snapshot_lock) {
+        apr_thread_mutex_lock(snapshot_lock);
+        if ((current_snapshot == NULL || current_snapshot->version != version) && !snapshot_building) {
+            pool = create_private_pool(snapshot_pool);
+            if (pool)
+                snapshot_building = 1;
+        }
+        snap = current_snapshot;
+        if (snap)
+            snap->refcount++;
+        apr_thread_mutex_unlock(snapshot_lock);
+
+        if (pool) {
+            proxy_cluster_snapshot *next = build_snapshot(pool);
+            apr_thread_mutex_lock(snapshot_lock);
+            if (current_snapshot)
+                release_snapshot(current_snapshot);
+            current_snapshot = next;
+            snapshot_building = 0;
+            /* pin the new one instead */
+            if (snap)
+                release_snapshot(snap);
+            snap = next;
+            snap->refcount++;
+            apr_thread_mutex_unlock(snapshot_lock);
+#if HAVE_CLUSTER_EX_DEBUG
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
+                         "pin_snapshot: new snapshot version %u", snap->version);
+#endif
+        }
+    }
+    if (snap) {
+        apr_pool_cleanup_register(r->pool, snap, unpin_snapshot, apr_pool_cleanup_null);
+        return snap;
+    }
+
+    /* No process snapshot (child_init not done or the first one being built) use a private copy */
+    snap = apr_palloc(r->pool, sizeof(proxy_cluster_snapshot));
+    snap->pool = r->pool;
+    snap->refcount = 0;
+    read_snapshot_tables(r->pool, snap);
+    return snap;
+}
+
+/*
+ * Get the routing snapshot of the request, repin it if the tables have
+ * changed since it was pinned (failover after a change in the cluster).
+ */
+static proxy_cluster_snapshot *get_snapshot(request_rec *r)
+{
+    proxy_cluster_snapshot *snap = (proxy_cluster_snapshot *) apr_table_get(r->notes, "cluster-snapshot");
+    if (snap && snap->version == node_storage->get_version_node())
+        return snap;
+    snap = pin_snapshot(r);
+    apr_table_setn(r->notes, "cluster-snapshot", (char *) snap);
+    return snap;
+}
+
+/*
+ * Check the contexts ending in a trie element against the host alias and
+ * balancer bitsets.
+ * @return 1 if one of them is usable.
+ */
+static int context_trie_ok(proxy_context_trie *trie, unsigned char *hostok, unsigned char *balancerok)
+{
+    int i;
+    int *contexts = (int *) trie->contexts->elts;
+    for (i = 0; i < trie->contexts->nelts; i++) {
+        if (hostok && !CLUSTER_BITSET_ISSET(hostok, contexts[i]))
+            continue;
+        if (balancerok && !CLUSTER_BITSET_ISSET(balancerok, contexts[i]))
+            continue;
+        return 1;
+    }
+    return 0;
+}
+
 /**
  * Find the best nodes for a request (check host and context (and balancer))
  * @param r the request_rec
@@ -1526,11 +2282,12 @@ static  nodeinfo_t* table_get_node(proxy_node_table *node_table, int id)
  */
 static node_context *find_node_context_host(request_rec *r, proxy_balancer *balancer, const char *route, int use_alias, proxy_vhost_table* vhost_table, proxy_context_table* context_table, proxy_node_table *node_table)
 {
-    int sizecontext = context_table->sizecontext;
+    proxy_context_index *index = context_table->index;
+    proxy_context_trie *trie, *longest;
+    unsigned char *hostok = NULL;
+    unsigned char *balancerok = NULL;
     int *contexts;
-    int *length;
-    int *status;
-    int i, j, max;
+    int i, len;
     node_context *best;
     int nbest;
     const char *uri = NULL;
@@ -1556,113 +2313,89 @@ static node_context *find_node_context_host(request_rec *r, proxy_balancer *bala
     }
 
     /* read the contexts */
-    if (sizecontext == 0)
+    if (context_table->sizecontext == 0 || index == NULL)
         return NULL;
-    contexts =  apr_palloc(r->pool, sizeof(int)*sizecontext);
-    for (i=0; i < sizecontext; i++)
-        contexts[i] = i;
-    length =  apr_pcalloc(r->pool, sizeof(int)*sizecontext);
-    status =  apr_palloc(r->pool, sizeof(int)*sizecontext);
+
     /* Check the virtual host */
     if (use_alias) {
-        /* read the hosts */
-        int sizevhost;
-        int *contextsok = apr_pcalloc(r->pool, sizeof(int)*sizecontext);
         const char *hostname = ap_get_server_name(r);
 #if HAVE_CLUSTER_EX_DEBUG
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                      "find_node_context_host: Host: %s", hostname);
 #endif
-        sizevhost = vhost_table->sizevhost;
-        for (i=0; i<sizevhost; i++) {
-            hostinfo_t *vhost = vhost_table->vhost_info + i;
-            if (strcmp(hostname, vhost->host) == 0) {
-                /* add the contexts that match */
-                for (j=0; j<sizecontext; j++) {
-                    contextinfo_t *context = &context_table->context_info[j];
-                    if (context->vhost == vhost->vhost && context->node == vhost->node)
-                        contextsok[j] = 1;
-                }
-            }
-        }
-        for (j=0; j<sizecontext; j++) {
-            if (!contextsok[j])
-                contexts[j] = -1;
-        }
-    }
-#if HAVE_CLUSTER_EX_DEBUG
-    for (j=0; j<sizecontext; j++) {
-        contextinfo_t *context;
-        if (contexts[j] == -1) continue;
-        context = &context_table->context_info[j]; 
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
-                         "find_node_context_host: %s node: %d vhost: %d context: %s",
-                          uri, context->node, context->vhost, context->context);
+        hostok = apr_hash_get(index->aliases, hostname, APR_HASH_KEY_STRING);
+        if (hostok == NULL)
+            return NULL;
     }
-#endif
-
-    /* Check the contexts */
-    max = 0;
-    for (j=0; j<sizecontext; j++) {
-        contextinfo_t *context;
-        int len;
-        if (contexts[j] == -1) continue;
-        context = &context_table->context_info[j];
 
-        /* keep only the contexts corresponding to our balancer */
-        if (balancer != NULL) {
+    /* keep only the contexts corresponding to our balancer */
+    if (balancer != NULL) {
+        if (strlen(balancer->s->name) > 11) {
+            char *name = apr_pstrdup(r->pool, &balancer->s->name[11]);
+            ap_str_tolower(name);
+            balancerok = apr_hash_get(index->balancers, name, APR_HASH_KEY_STRING);
+            if (balancerok == NULL)
+                return NULL;
+        } else {
+            balancerok = index->withnode;
+        }
+    }
 
-            nodeinfo_t *node =  table_get_node(node_table, context->node);
-            if (node == NULL)
-                continue;
-            if (strlen(balancer->s->name) > 11 && strcasecmp(&balancer->s->name[11], node->mess.balancer) != 0)
-                continue;
+    /* Check the contexts: longest match in the trie */
+    longest = NULL;
+    trie = &index->root;
+    for (len = 1; uri[len - 1] != '\0'; len++) {
+        proxy_context_trie *child;
+        for (child = trie->child; child; child = child->next) {
+            if (child->c == uri[len - 1])
+                break;
         }
-        len = strlen(context->context);
-        if (strncmp(uri, context->context, len) == 0) {
-            if (uri[len] == '\0' || uri[len] == '/' || len==1) {
-                status[j] = context->status;
-                length[j] = len;
-                if (len > max) {
-                    max = len;
-                } 
-            }
+        if (child == NULL)
+            break;
+        trie = child;
+        if (trie->contexts && (uri[len] == '\0' || uri[len] == '/' || len == 1)) {
+            if (context_trie_ok(trie, hostok, balancerok))
+                longest = trie;
         }
     }
-    if (max == 0)
+    if (longest == NULL)
         return NULL;
 
-
     /* find the best matching contexts */
-    nbest = 1;
-    for (j=0; j<sizecontext; j++)
-        if (length[j] == max)
-            nbest++;
-    best =  apr_palloc(r->pool, sizeof(node_context)*nbest);
+    contexts = (int *) longest->contexts->elts;
+    best =  apr_palloc(r->pool, sizeof(node_context)*(longest->contexts->nelts + 1));
     nbest  = 0;
-    for (j=0; j<sizecontext; j++)
-        if (length[j] == max) {
-            contextinfo_t *context;
-            int ok = 0;
-            context = &context_table->context_info[j];
-            /* Check status */
-            switch (status[j]) {
-                case ENABLED:
+    for (i = 0; i < longest->contexts->nelts; i++) {
+        contextinfo_t *context;
+        int ok = 0;
+        if (hostok && !CLUSTER_BITSET_ISSET(hostok, contexts[i]))
+            continue;
+        if (balancerok && !CLUSTER_BITSET_ISSET(balancerok, contexts[i]))
+            continue;
+        context = &context_table->context_info[contexts[i]];
+#if HAVE_CLUSTER_EX_DEBUG
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
+                         "find_node_context_host: %s node: %d vhost: %d context: %s",
+                          uri, context->node, context->vhost, context->context);
+#endif
+        /* Check status */
+        switch (context->status) {
+            case ENABLED:
+                ok = -1;
+                break;
+            case DISABLED:
+                /* Only the request with sessionid ok for it */
+                if (hassession_byname(r, context->node, route)) {
                     ok = -1;
-                    break;
-                case DISABLED:
-                    /* Only the request with sessionid ok for it */
-                    if (hassession_byname(r, context->node, route)) {
-                        ok = -1;
-                    }
-                    break;
-            }
-            if (ok) {
-                best[nbest].node = context->node;
-                best[nbest].context = context->id;
-                nbest++;
-            }
+                }
+                break;
         }
+        if (ok) {
+            best[nbest].node = context->node;
+            best[nbest].context = context->id;
+            nbest++;
+        }
+    }
     if (nbest == 0)
         return NULL;
     best[nbest].node = -1;
@@ -1706,6 +2439,23 @@ static char *get_context_host_balancer(request_rec *r,
     }
     return NULL;
 }
+/*
+ * Nodes selected by find_node_context_host() for the workers checks of the
+ * request, they don't change until the uri, route or balancer change.
+ */
+struct node_context_cache
+{
+    proxy_balancer *balancer;
+    proxy_context_table *context_table;
+    const char *route;
+    const char *uri;
+    const char *filename;
+    int use_alias;
+    node_context *best;
+    unsigned char *nodes; /* bitset of the nodes in best */
+};
+typedef struct node_context_cache node_context_cache;
+
 /*
  * Return the node cotenxt Check that the worker will handle the host/context.
  * de
@@ -1718,32 +2468,60 @@ static node_context *context_host_ok(request_rec *r, proxy_balancer *balancer, i
 {
     const char *route;
     node_context *best;
+    node_context_cache *cache;
     route = apr_table_get(r->notes, "session-route");
-    best = find_node_context_host(r, balancer, route, use_alias, vhost_table, context_table, node_table);
-    if (best == NULL)
-        return NULL;
-    while ((*best).node != -1) {
-        if ((*best).node == node) break;
-        best++;
+    cache = (node_context_cache *) apr_table_get(r->notes, "node-context-cache");
+    if (cache == NULL || cache->balancer != balancer || cache->context_table != context_table ||
+        cache->route != route || cache->uri != r->uri || cache->filename != r->filename ||
+        cache->use_alias != use_alias) {
+        cache = apr_palloc(r->pool, sizeof(node_context_cache));
+        cache->balancer = balancer;
+        cache->context_table = context_table;
+        cache->route = route;
+        cache->uri = r->uri;
+        cache->filename = r->filename;
+        cache->use_alias = use_alias;
+        cache->best = find_node_context_host(r, balancer, route, use_alias, vhost_table, context_table, node_table);
+        cache->nodes = NULL;
+        if (cache->best && context_table->index) {
+            int maxnode = context_table->index->maxnode;
+            cache->nodes = apr_pcalloc(r->pool, CLUSTER_BITSET_SIZE(maxnode));
+            for (best = cache->best; (*best).node != -1; best++) {
+                if ((*best).node > 0 && (*best).node <= maxnode)
+                    CLUSTER_BITSET_SET(cache->nodes, (*best).node);
+            }
+        }
+        apr_table_setn(r->notes, "node-context-cache", (char *) cache);
     }
-    if ((*best).node == -1)
+    if (cache->nodes == NULL || node <= 0 || node > context_table->index->maxnode ||
+        !CLUSTER_BITSET_ISSET(cache->nodes, node))
         return NULL; /* not found */
-    return best;
+    for (best = cache->best; (*best).node != -1; best++) {
+        if ((*best).node == node)
+            return best;
+    }
+    return NULL;
 }
 
 /*
  * Check that the worker corresponds to a node that belongs to the same domain according to the JVMRoute.
+ * domainhash is node_storage->hash_domain(domain): the node configuration is only read when the
+ * hashes are equal, to tell the domains with the same hash apart.
  */ 
-static int isnode_domain_ok(request_rec *r, nodeinfo_t *node,
-                             const char *domain)
+static int isnode_domain_ok(request_rec *r, nodehot_t *node, int id, proxy_node_table *node_table,
+                             const char *domain, unsigned int domainhash)
 {
+    nodemess_t *mess;
 #if HAVE_CLUSTER_EX_DEBUG
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
-                     "isnode_domain_ok: domain %s:%s", domain, node->mess.Domain);
+                     "isnode_domain_ok: domain %s:%u:%u", domain, domainhash, node->domain);
 #endif
     if (domain == NULL)
         return 1; /* OK no domain in the corresponding to the SESSIONID */
-    if (strcmp(node->mess.Domain, domain) == 0)
+    if (node->domain != domainhash)
+        return 0;
+    mess = table_get_node(node_table, id);
+    if (mess && strcmp(mess->Domain, domain) == 0)
         return 1; /* OK */
     return 0;
 }
@@ -1760,21 +2538,29 @@ static proxy_worker *internal_find_best_byrequests(proxy_balancer *balancer, pro
                                          proxy_vhost_table *vhost_table,
                                          proxy_context_table *context_table, proxy_node_table *node_table)
 {
-    int i, hash = 0;
+    int i;
     proxy_worker *mycandidate = NULL;
     node_context *mynodecontext = NULL;
     proxy_worker *worker;
     int checking_standby = 0;
     int checked_standby = 0;
     int checked_domain = 1;
-    /* Create a separate array of available workers, to be sorted later */
-    proxy_worker **workers = NULL;
-    int workers_length = 0;
     const char *session_id_with_route;
-    char *tokenizer;
-    const char *session_id;
-
-    workers = apr_pcalloc(r->pool, sizeof(proxy_worker *) * balancer->workers->nelts);
+    const char *dot;
+    unsigned int domainhash = node_storage->hash_domain(domain);
+    /* deterministic failover: rendezvous hashing of the session id on the routes */
+    int rendezvous = 0;
+    apr_uint64_t sessionhash = 0;
+    apr_uint64_t rdvscore = 0;
+    proxy_worker *rdvcandidate = NULL;
+    node_context *rdvnodecontext = NULL;
+
+    /* Determine deterministic route, if session is associated with a route, but that route wasn't used */
+    session_id_with_route = apr_table_get(r->notes, "session-id");
+    if (deterministic_failover && session_id_with_route && (dot = strchr(session_id_with_route, '.')) != NULL) {
+        rendezvous = 1;
+        sessionhash = hash_fnv1a(session_id_with_route, dot - session_id_with_route);
+    }
 #if HAVE_CLUSTER_EX_DEBUG
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                  "proxy: Entering byrequests for CLUSTER (%s) failoverdomain:%d",
@@ -1793,10 +2579,9 @@ static proxy_worker *internal_find_best_byrequests(proxy_balancer *balancer, pro
         int sizew = balancer->workers->elt_size;
         for (i = 0; i < balancer->workers->nelts; i++, ptr=ptr+sizew) {
             node_context *nodecontext;
-            nodeinfo_t *node;
+            nodehot_t *node;
             proxy_cluster_helper *helper;
             proxy_worker **run = (proxy_worker **) ptr;
-            char *pptr;
 
             worker = *run;
             helper = (proxy_cluster_helper *) worker->context;
@@ -1831,21 +2616,27 @@ static proxy_worker *internal_find_best_byrequests(proxy_balancer *balancer, pro
              * not in error state or not disabled.
              * and that can map the context.
              */
-            if (read_node_worker(worker->s->index, &node, worker) != APR_SUCCESS)
-                continue; /* Can't read node */
-            pptr = (char *) node;
-            pptr = pptr + node->offset;
-            if (worker->s != (proxy_worker_shared *) pptr)
-                continue; /* wrong shared memory address */
+            if (read_node_hot_worker(worker->s->index, &node, worker) != APR_SUCCESS)
+                continue; /* Can't read node or the worker doesn't correspond to it */
+            if (node_is_ejected(node))
+                continue; /* outlier */
 
             if (PROXY_WORKER_IS_USABLE(worker) && (nodecontext = context_host_ok(r, balancer, worker->s->index, vhost_table, context_table, node_table)) != NULL) {
                 if (!checked_domain) {
                     /* First try only nodes in the domain */
-                    if (!isnode_domain_ok(r, node, domain)) {
+                    if (!isnode_domain_ok(r, node, worker->s->index, node_table, domain, domainhash)) {
                         continue;
                     }
                 }
-                workers[workers_length++] = worker;
+                if (rendezvous) {
+                    /* the highest score wins: when a node leaves only its sessions move */
+                    apr_uint64_t score = hash_mix(sessionhash ^ hash_fnv1a(worker->s->route, strlen(worker->s->route)));
+                    if (!rdvcandidate || score > rdvscore) {
+                        rdvcandidate = worker;
+                        rdvnodecontext = nodecontext;
+                        rdvscore = score;
+                    }
+                }
                 if (worker->s->lbfactor == 0 && checking_standby) {
                     mycandidate = worker;
                     mynodecontext = nodecontext;
@@ -1855,13 +2646,13 @@ static proxy_worker *internal_find_best_byrequests(proxy_balancer *balancer, pro
                         mycandidate = worker;
                         mynodecontext = nodecontext;
                     } else {
-                        nodeinfo_t *node1;
+                        nodehot_t *node1;
                         int lbstatus, lbstatus1;
 
-                        if (read_node_worker(mycandidate->s->index, &node1, mycandidate) != APR_SUCCESS)
+                        if (read_node_hot_worker(mycandidate->s->index, &node1, mycandidate) != APR_SUCCESS)
                             continue;
-                        lbstatus1 = ((mycandidate->s->elected - node1->mess.oldelected) * 1000)/mycandidate->s->lbfactor;
-                        lbstatus  = ((worker->s->elected - node->mess.oldelected) * 1000)/worker->s->lbfactor;
+                        lbstatus1 = ((mycandidate->s->elected - node1->oldelected) * 1000)/effective_lbfactor(mycandidate, node1);
+                        lbstatus  = ((worker->s->elected - node->oldelected) * 1000)/effective_lbfactor(worker, node);
                         lbstatus1 = lbstatus1 + mycandidate->s->lbstatus;
                         lbstatus = lbstatus + worker->s->lbstatus;
                         if (lbstatus1> lbstatus) {
@@ -1872,19 +2663,10 @@ static proxy_worker *internal_find_best_byrequests(proxy_balancer *balancer, pro
                 }
             }
         }
-        session_id_with_route = apr_table_get(r->notes, "session-id");
-        session_id = session_id_with_route ? apr_strtok(strdup(session_id_with_route), ".", &tokenizer) : NULL;
-        /* Determine deterministic route, if session is associated with a route, but that route wasn't used */
-        if (deterministic_failover && session_id && strchr((char *)session_id_with_route, '.') && workers_length > 0) {
+        if (rdvcandidate) {
             /* Deterministic selection of target route */
-            if (workers_length > 1) {
-	            qsort(workers, workers_length, sizeof(*workers), &proxy_worker_cmp);
-	        }
-            /* Compute consistent int from session id */
-            for (i = 0; session_id[i] != 0; ++i) {
-                hash += session_id[i];
-            }
-            mycandidate = workers[hash % workers_length];
+            mycandidate = rdvcandidate;
+            mynodecontext = rdvnodecontext;
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "Using deterministic failover target: %s", mycandidate->s->route);
         }
         if (mycandidate)
@@ -1932,6 +2714,7 @@ static int proxy_node_isup(request_rec *r, int id, int load)
     nodeinfo_t *node;
     proxy_worker_shared *stat;
     char *ptr;
+    int was_down;
 
     if (node_storage->read_node(id, &node) != APR_SUCCESS)
         return 500;
@@ -1953,7 +2736,7 @@ static int proxy_node_isup(request_rec *r, int id, int load)
         void *sconf = s->module_config;
         conf = (proxy_server_conf *) ap_get_module_config(sconf, &proxy_module);
 
-        worker = get_worker_from_id_stat(conf, id, stat, node);
+        worker = get_worker_from_id_stat(s, id, stat, node);
         if (worker != NULL)
             break;
         s = s->next;
@@ -1964,6 +2747,9 @@ static int proxy_node_isup(request_rec *r, int id, int load)
         return 500;
     }
 
+    /* the lbfactor of a new worker is -1 until its first STATUS */
+    was_down = (worker->s->status & PROXY_WORKER_IN_ERROR) || worker->s->lbfactor < 0;
+
     /* Try a  ping/pong to check the node */
     if (load >= 0 || load == -2) {
         /* Only try usuable nodes */
@@ -1995,11 +2781,18 @@ static int proxy_node_isup(request_rec *r, int id, int load)
         worker->s->lbfactor = 0;
     }
     else {
+        if (was_down) {
+            /* new node or back from error: ramp its weight */
+            nodehot_t *hot;
+            if (node_storage->read_node_hot(id, &hot) == APR_SUCCESS)
+                apr_atomic_set32(&hot->slowstart, (apr_uint32_t) apr_time_sec(apr_time_now()));
+        }
         worker->s->status &= ~PROXY_WORKER_IN_ERROR;
         worker->s->status &= ~PROXY_WORKER_STOPPED;
         worker->s->status &= ~PROXY_WORKER_DISABLED;
         worker->s->status &= ~PROXY_WORKER_HOT_STANDBY;
         worker->s->lbfactor = load;
+        wake_waiters(node->mess.balancer);
     }
     return 0;
 }
@@ -2090,9 +2883,13 @@ static void remove_removed_node(apr_pool_t *pool)
                     domain_storage->insert_update_domain(&dom);
                 }
             }
-            /* remove the node from the shared memory */
-            node_storage->remove_host_context(ou->mess.id, pool);
-            node_storage->remove_node(ou);
+            /* remove the node from the shared memory, like MCMP with the nodes lock */
+            node_storage->lock_nodes();
+            if (ou->mess.remove) {
+                node_storage->remove_host_context(ou->mess.id, pool);
+                node_storage->remove_node(ou);
+            }
+            node_storage->unlock_nodes();
         }
     }
 }
@@ -2130,6 +2927,7 @@ static void * APR_THREAD_FUNC proxy_cluster_watchdog_func(apr_thread_t *thd, voi
         proxy_server_conf *conf = (proxy_server_conf *)
             ap_get_module_config(sconf, &proxy_module);
         unsigned int last;
+        int leader;
 
         if (!conf)
            break;
@@ -2149,6 +2947,8 @@ static void * APR_THREAD_FUNC proxy_cluster_watchdog_func(apr_thread_t *thd, voi
 
         apr_pool_create(&pool, conf->pool);
         last = node_storage->worker_nodes_need_update(main_server, pool);
+        /* one child does the cluster-wide work, the others use its results */
+        leader = node_storage->take_maintenance_lease(MAINTENANCE_LEASE);
         while (s) {
             sconf = s->module_config;
             conf = (proxy_server_conf *)
@@ -2159,15 +2959,30 @@ static void * APR_THREAD_FUNC proxy_cluster_watchdog_func(apr_thread_t *thd, voi
                 update_workers_node(conf, pool, s, 0);
             /* removed nodes: check for workers */
             remove_workers_nodes(conf, pool, s);
-            /* Calculate the lbstatus for each node */
-            update_workers_lbstatus(conf, pool, s);
+            s = s->next;
+        }
+        /* the lease is renewed before each step: a slow pass keeps it or stops once it is lost */
+        if (leader) {
             /* Free sessionid slots */
             if (sessionid_storage)
-                remove_timeout_sessionid(conf, pool, s);
-            s = s->next;
+                remove_timeout_sessionid(pool);
+            /* Calculate the lbstatus for each node (ping the idle ones) */
+            leader = node_storage->take_maintenance_lease(MAINTENANCE_LEASE);
+            if (leader)
+                update_workers_lbstatus(pool, main_server);
+        }
+        if (leader && outlier_detection) {
+            /* eject the nodes that are slow or failing */
+            leader = node_storage->take_maintenance_lease(MAINTENANCE_LEASE);
+            if (leader)
+                detect_outliers(pool, main_server);
+        }
+        if (leader) {
+            /* cleanup removed node in shared memory */
+            leader = node_storage->take_maintenance_lease(MAINTENANCE_LEASE);
+            if (leader)
+                remove_removed_node(pool);
         }
-        /* cleanup removed node in shared memory */
-        remove_removed_node(pool);
         apr_pool_destroy(pool);
         if (last)
             node_storage->worker_nodes_are_updated(main_server, last);
@@ -2203,6 +3018,8 @@ static int terminate_watchdog(void *data)
         ap_log_error(APLOG_MARK, APLOG_ERR, rv, main_server,
                     "terminate_watchdog: apr_thread_join failed");
     }
+    /* another child can take over the maintenance right now */
+    node_storage->release_maintenance_lease();
 
     return APR_SUCCESS;
 }
@@ -2231,6 +3048,51 @@ static void  proxy_cluster_child_init(apr_pool_t *p, server_rec *s)
                     "proxy_cluster_child_init: apr_thread_cond_create failed");
     }
 
+    /* routing snapshot shared by the threads of the process */
+    rv = apr_thread_mutex_create(&snapshot_lock, APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR|APLOG_NOERRNO, 0, s,
+                    "proxy_cluster_child_init: apr_thread_mutex_create failed");
+        snapshot_lock = NULL;
+    }
+    apr_pool_create(&snapshot_pool, p);
+
+    /* requests waiting for a free worker */
+    rv = apr_thread_mutex_create(&wait_lock, APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR|APLOG_NOERRNO, 0, s,
+                    "proxy_cluster_child_init: apr_thread_mutex_create failed");
+        wait_lock = NULL;
+    }
+    apr_pool_create(&wait_pool, p);
+    wait_queues = apr_hash_make(wait_pool);
+
+    /* resolved sticky routes */
+    if (route_cache_size > 0) {
+        int i;
+        route_cache = apr_pcalloc(p, sizeof(proxy_route_stripe) * ROUTE_CACHE_STRIPES);
+        for (i = 0; i < ROUTE_CACHE_STRIPES; i++) {
+            apr_pool_t *pool;
+            rv = apr_thread_mutex_create(&route_cache[i].lock, APR_THREAD_MUTEX_DEFAULT, p);
+            if (rv != APR_SUCCESS) {
+                ap_log_error(APLOG_MARK, APLOG_ERR|APLOG_NOERRNO, 0, s,
+                            "proxy_cluster_child_init: apr_thread_mutex_create failed");
+                route_cache = NULL;
+                break;
+            }
+            /* the stripes allocate concurrently: a pool each */
+            pool = create_private_pool(p);
+            if (pool == NULL) {
+                ap_log_error(APLOG_MARK, APLOG_ERR|APLOG_NOERRNO, 0, s,
+                            "proxy_cluster_child_init: can't create the route cache pool");
+                route_cache = NULL;
+                break;
+            }
+            route_cache[i].entries = apr_hash_make(pool);
+            route_cache[i].max = (route_cache_size + ROUTE_CACHE_STRIPES - 1) / ROUTE_CACHE_STRIPES;
+        }
+    }
+
     if (conf) {
         apr_pool_t *pool;
         apr_pool_create(&pool, conf->pool);
@@ -2239,6 +3101,7 @@ static void  proxy_cluster_child_init(apr_pool_t *p, server_rec *s)
             conf = (proxy_server_conf *)
                 ap_get_module_config(sconf, &proxy_module);
 
+            /* initializes the workers created in post_config too */
             update_workers_node(conf, pool, s, 0);
 
             s = s->next;
@@ -2255,6 +3118,57 @@ static void  proxy_cluster_child_init(apr_pool_t *p, server_rec *s)
     apr_pool_pre_cleanup_register(p, NULL, terminate_watchdog);
 }
 
+/*
+ * Create the balancers and the workers of the nodes already in the shared
+ * table (kept across a graceful restart) in the parent, the children get
+ * them with the fork and only have to initialize them in child_init.
+ */
+static void precreate_workers_node(server_rec *s, apr_pool_t *pool)
+{
+    int *id, size, i;
+    apr_uint32_t version = (apr_uint32_t) node_storage->get_version_node() + 1;
+
+    size = node_storage->get_max_size_node();
+    if (size == 0)
+        return;
+    id = apr_pcalloc(pool, sizeof(int) * size);
+    size = node_storage->get_ids_used_node(id);
+    if (size == 0)
+        return;
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                 "proxy_cluster_post_config: creating the workers of %d nodes", size);
+
+    /*
+     * The busy count of a slot copied from the previous segment holds the
+     * requests in flight in the old children, they decrement the old copy:
+     * the new generation starts without them.
+     */
+    for (i=0; i<size; i++) {
+        nodeinfo_t *ou;
+        if (node_storage->read_node(id[i], &ou) == APR_SUCCESS) {
+            proxy_worker_shared *stat = (proxy_worker_shared *) ((char *) ou + ou->offset);
+            stat->busy = 0;
+        }
+    }
+
+    defer_worker_init = 1;
+    for (; s; s = s->next) {
+        proxy_server_conf *conf = (proxy_server_conf *) ap_get_module_config(s->module_config, &proxy_module);
+        proxy_cluster_server_conf *cconf = ap_get_module_config(s->module_config, &proxy_cluster_module);
+        for (i=0; i<size; i++) {
+            nodeinfo_t *ou;
+            if (node_storage->read_node(id[i], &ou) != APR_SUCCESS)
+                continue;
+            if (ou->mess.remove)
+                continue;
+            add_balancers_workers_for_server(ou, pool, s);
+        }
+        cconf->workers_version = version;
+    }
+    defer_worker_init = 0;
+}
+
 static int proxy_cluster_post_config(apr_pool_t *p, apr_pool_t *plog,
                                      apr_pool_t *ptemp, server_rec *s)
 {
@@ -2337,6 +3251,14 @@ static int proxy_cluster_post_config(apr_pool_t *p, apr_pool_t *plog,
         }
     }
 
+    /* the workers are indexed by node id in each VirtualHost */
+    unshare_server_conf(s, p);
+    create_worker_index(s, p);
+
+    /* Warm restart: the routing is ready when the first child starts */
+    main_server = s;
+    precreate_workers_node(s, ptemp);
+
     /* Add version information */
     ap_add_version_component(p, MOD_CLUSTER_EXPOSED_VERSION);
     return OK;
@@ -2372,6 +3294,135 @@ static apr_status_t find_nodedomain(request_rec *r, char **domain, char *route,
     return APR_NOTFOUND;
 }
 
+/* build the cache key and return the stripe, NULL if not cached */
+static proxy_route_stripe *route_cache_key(proxy_balancer *balancer, const char *route, char *key, apr_ssize_t *klen)
+{
+    apr_size_t len = strlen(route);
+    if (route_cache == NULL || len > JVMROUTESZ)
+        return NULL;
+    memcpy(key, &balancer, sizeof(proxy_balancer *));
+    memcpy(key + sizeof(proxy_balancer *), route, len);
+    *klen = sizeof(proxy_balancer *) + len;
+    return &route_cache[hash_mix(hash_fnv1a(key, *klen)) % ROUTE_CACHE_STRIPES];
+}
+
+/* move the entry at the head of the LRU, stripe->lock must be held */
+static void route_cache_touch(proxy_route_stripe *stripe, proxy_route_entry *entry)
+{
+    if (stripe->mru == entry)
+        return;
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    if (stripe->lru == entry)
+        stripe->lru = entry->prev;
+    entry->prev = NULL;
+    entry->next = stripe->mru;
+    if (stripe->mru)
+        stripe->mru->prev = entry;
+    stripe->mru = entry;
+    if (stripe->lru == NULL)
+        stripe->lru = entry;
+}
+
+/*
+ * Look for the route in the cache: copy the domain and the worker of a
+ * valid entry.
+ * @return APR_SUCCESS if found, APR_NOTFOUND otherwise.
+ */
+static apr_status_t route_cache_get(request_rec *r, proxy_balancer *balancer, const char *route,
+                                    char **domain, proxy_worker **worker)
+{
+    char key[sizeof(proxy_balancer *) + JVMROUTESZ + 1];
+    apr_ssize_t klen;
+    proxy_route_entry *entry;
+    apr_status_t rv = APR_NOTFOUND;
+    proxy_route_stripe *stripe = route_cache_key(balancer, route, key, &klen);
+
+    if (stripe == NULL)
+        return APR_NOTFOUND;
+    apr_thread_mutex_lock(stripe->lock);
+    entry = apr_hash_get(stripe->entries, key, klen);
+    if (entry && entry->version == node_storage->get_version_node()) {
+        route_cache_touch(stripe, entry);
+        if (domain)
+            *domain = entry->hasdomain ? apr_pstrdup(r->pool, entry->domain) : NULL;
+        if (worker)
+            *worker = entry->worker;
+        rv = APR_SUCCESS;
+    }
+    apr_thread_mutex_unlock(stripe->lock);
+    return rv;
+}
+
+/*
+ * Store the domain (set) or the worker (worker != NULL) of the route,
+ * the least recently used entry of the stripe is reused when it is full.
+ */
+static void route_cache_put(proxy_balancer *balancer, const char *route, int set, const char *domain,
+                            proxy_worker *worker)
+{
+    char key[sizeof(proxy_balancer *) + JVMROUTESZ + 1];
+    apr_ssize_t klen;
+    proxy_route_entry *entry;
+    unsigned int version = node_storage->get_version_node();
+    proxy_route_stripe *stripe = route_cache_key(balancer, route, key, &klen);
+
+    if (stripe == NULL)
+        return;
+    apr_thread_mutex_lock(stripe->lock);
+    entry = apr_hash_get(stripe->entries, key, klen);
+    if (entry == NULL) {
+        if (!set) {
+            /* the worker only completes an entry made by get_route_balancer() */
+            apr_thread_mutex_unlock(stripe->lock);
+            return;
+        }
+        if (stripe->count < stripe->max) {
+            entry = apr_pcalloc(apr_hash_pool_get(stripe->entries), sizeof(proxy_route_entry));
+            stripe->count++;
+        } else {
+            entry = stripe->lru;
+            apr_hash_set(stripe->entries, entry->key, entry->klen, NULL);
+        }
+        memcpy(entry->key, key, klen);
+        entry->klen = klen;
+        apr_hash_set(stripe->entries, entry->key, entry->klen, entry);
+        entry->version = version - 1;
+    }
+    if (entry->version != version) {
+        if (!set) {
+            /* the domain was resolved with an older table */
+            apr_thread_mutex_unlock(stripe->lock);
+            return;
+        }
+        entry->version = version;
+        entry->hasdomain = 0;
+        entry->worker = NULL;
+    }
+    if (set) {
+        entry->hasdomain = (domain != NULL);
+        if (domain)
+            apr_cpystrn(entry->domain, domain, sizeof(entry->domain));
+    }
+    if (worker)
+        entry->worker = worker;
+    route_cache_touch(stripe, entry);
+    apr_thread_mutex_unlock(stripe->lock);
+}
+
+/* find_nodedomain() using the route cache */
+static apr_status_t find_nodedomain_cached(request_rec *r, char **domain, char *route, proxy_balancer *balancer)
+{
+    if (route_cache_get(r, balancer, route, domain, NULL) == APR_SUCCESS)
+        return APR_SUCCESS;
+    if (find_nodedomain(r, domain, route, &balancer->s->name[11]) != APR_SUCCESS)
+        return APR_NOTFOUND;
+    route_cache_put(balancer, route, 1, *domain, NULL);
+    return APR_SUCCESS;
+}
+
 /**
  * Find the balancer corresponding to the node information
  */
@@ -2383,8 +3434,7 @@ static const char *get_route_balancer(request_rec *r, proxy_server_conf *conf,
 {
     char *route = NULL;
     char *sessionid = NULL;
-    char *sticky_used;
-    char *sticky;
+    const char *sticky_used;
     int i;
     char *ptr = conf->balancers->elts;
     int sizeb = conf->balancers->elt_size;
@@ -2396,16 +3446,15 @@ static const char *get_route_balancer(request_rec *r, proxy_server_conf *conf,
             continue;
         if (strlen(balancer->s->name)<=11)
             continue;
-        sticky = apr_psprintf(r->pool, "%s|%s", balancer->s->sticky, balancer->s->sticky_path);
         if (strncmp(balancer->s->lbpname, "MC", 2))
             continue;
 
-        sessionid = cluster_get_sessionid(r, sticky, r->uri, &sticky_used);
+        sessionid = cluster_get_sessionid(r, balancer->s->sticky, balancer->s->sticky_path, r->uri, &sticky_used);
         if (sessionid) {
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                          "cluster: %s Found value %s for "
-                         "stickysession %s",
-                         balancer->s->name, sessionid, sticky);
+                         "stickysession %s|%s",
+                         balancer->s->name, sessionid, balancer->s->sticky, balancer->s->sticky_path);
             apr_table_setn(r->notes, "session-id", sessionid);
             if ((route = strchr(sessionid, '.')) != NULL )
                 route++;
@@ -2421,7 +3470,7 @@ static const char *get_route_balancer(request_rec *r, proxy_server_conf *conf,
                 ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                                           "cluster: Found route %s", route);
 #endif
-                if (find_nodedomain(r, &domain, route, &balancer->s->name[11]) == APR_SUCCESS) {
+                if (find_nodedomain_cached(r, &domain, route, balancer) == APR_SUCCESS) {
 #if HAVE_CLUSTER_EX_DEBUG
                     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                                 "cluster: Found balancer %s for %s",
@@ -2551,15 +3600,11 @@ static int proxy_cluster_trans(request_rec *r)
     proxy_server_conf *conf = (proxy_server_conf *)
         ap_get_module_config(sconf, &proxy_module);
 
-    proxy_vhost_table *vhost_table = read_vhost_table(r);
-    proxy_context_table *context_table = read_context_table(r);
-    proxy_balancer_table *balancer_table = read_balancer_table(r);
-    proxy_node_table *node_table = read_node_table(r);
-
-    apr_table_setn(r->notes, "vhost-table",  (char *) vhost_table);
-    apr_table_setn(r->notes, "context-table",  (char *) context_table);
-    apr_table_setn(r->notes, "balancer-table",  (char *) balancer_table);
-    apr_table_setn(r->notes, "node-table",  (char *) node_table);
+    proxy_cluster_snapshot *snap = get_snapshot(r);
+    proxy_vhost_table *vhost_table = &snap->vhost_table;
+    proxy_context_table *context_table = &snap->context_table;
+    proxy_balancer_table *balancer_table = &snap->balancer_table;
+    proxy_node_table *node_table = &snap->node_table;
 
 #if HAVE_CLUSTER_EX_DEBUG
     ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, 0, r->server,
@@ -2569,6 +3614,8 @@ static int proxy_cluster_trans(request_rec *r)
 
     /* make sure we have a up to date workers and balancers in our process */
     update_workers_node(conf, r->pool, r->server, 1);
+    /* split the session ids once for all the hooks */
+    get_session_params(r, r->uri);
     balancer = get_route_balancer(r, conf, vhost_table, context_table, balancer_table, node_table);
     if (!balancer) {
         balancer = get_context_host_balancer(r, vhost_table, context_table, node_table);
@@ -2701,24 +3748,10 @@ static int proxy_cluster_canon(request_rec *r, char *url)
         proxy_server_conf *conf = (proxy_server_conf *)
             ap_get_module_config(sconf, &proxy_module);
 
-        proxy_vhost_table *vhost_table = (proxy_vhost_table *) apr_table_get(r->notes, "vhost-table");
-        proxy_context_table *context_table  = (proxy_context_table *) apr_table_get(r->notes, "context-table");
-        proxy_balancer_table *balancer_table  = (proxy_balancer_table *) apr_table_get(r->notes, "balancer-table");
-        proxy_node_table *node_table  = (proxy_node_table *) apr_table_get(r->notes, "node-table");
-
-        if (!vhost_table)
-            vhost_table = read_vhost_table(r);
-
-        if (!context_table)
-            context_table = read_context_table(r);
-
-        if (!balancer_table)
-            balancer_table = read_balancer_table(r);
+        proxy_cluster_snapshot *snap = get_snapshot(r);
 
-        if (!node_table)
-            node_table = read_node_table(r);
-
-        get_route_balancer(r, conf, vhost_table, context_table, balancer_table, node_table);
+        get_route_balancer(r, conf, &snap->vhost_table, &snap->context_table,
+                           &snap->balancer_table, &snap->node_table);
     }
 
     return OK;
@@ -2764,8 +3797,8 @@ static proxy_worker *find_route_worker(request_rec *r,
                 /* that is the worker corresponding to the route */
                 if (worker && PROXY_WORKER_IS_USABLE(worker)) {
                     /* The context may not be available */
-                    nodeinfo_t *node;
-                    if (read_node_worker(index, &node, worker) != APR_SUCCESS)
+                    nodehot_t *node;
+                    if (read_node_hot_worker(index, &node, worker) != APR_SUCCESS)
                         return NULL; /* can't read node */
                     if ((nodecontext = context_host_ok(r, balancer, index, vhost_table, context_table, node_table)) != NULL) {
                         apr_table_setn(r->subprocess_env, "BALANCER_CONTEXT_ID", apr_psprintf(r->pool, "%d", (*nodecontext).context));
@@ -2883,9 +3916,24 @@ static proxy_worker *find_session_route(proxy_balancer *balancer,
         *domain = apr_table_get(r->notes, "CLUSTER_DOMAIN");
 
     /* We have a route in path or in cookie
-     * Find the worker that has this route defined.
+     * Find the worker that has this route defined (the cached one
+     * if it is still usable).
      */
+    if (route_cache_get(r, balancer, *route, NULL, &worker) == APR_SUCCESS && worker) {
+        proxy_cluster_helper *helper = (proxy_cluster_helper *) worker->context;
+        nodehot_t *node;
+        if (worker->s->index != 0 && worker->s->index == helper->index && PROXY_WORKER_IS_USABLE(worker) &&
+            read_node_hot_worker(worker->s->index, &node, worker) == APR_SUCCESS) {
+            node_context *nodecontext = context_host_ok(r, balancer, worker->s->index, vhost_table, context_table, node_table);
+            if (nodecontext == NULL)
+                return NULL; /* application has been removed from the node */
+            apr_table_setn(r->subprocess_env, "BALANCER_CONTEXT_ID", apr_psprintf(r->pool, "%d", (*nodecontext).context));
+            return worker;
+        }
+    }
     worker = find_route_worker(r, balancer, *route, vhost_table, context_table, node_table);
+    if (worker && strcmp(*route, worker->s->route) == 0)
+        route_cache_put(balancer, *route, 0, NULL, worker);
     if (worker && strcmp(*route, worker->s->route)) {
         /*
          * Notice that the route of the worker chosen is different from
@@ -2899,6 +3947,213 @@ static proxy_worker *find_session_route(proxy_balancer *balancer,
     return worker;
 }
 
+/*
+ * Check that the worker could take the request (not standby, usable, its node
+ * maps the context), return the corresponding node_context or NULL.
+ */
+static node_context *worker_can_take(request_rec *r, proxy_balancer *balancer, proxy_worker *worker,
+                                     nodehot_t **node,
+                                     proxy_vhost_table *vhost_table, proxy_context_table *context_table,
+                                     proxy_node_table *node_table)
+{
+    proxy_cluster_helper *helper = (proxy_cluster_helper *) worker->context;
+
+    if (!worker->s || !helper || helper->index == 0 || helper->index != worker->s->index)
+        return NULL;
+    if (worker->s->lbfactor <= 0 || !PROXY_WORKER_IS_USABLE(worker))
+        return NULL;
+    if (read_node_hot_worker(worker->s->index, node, worker) != APR_SUCCESS || node_is_ejected(*node))
+        return NULL;
+    return context_host_ok(r, balancer, worker->s->index, vhost_table, context_table, node_table);
+}
+
+/*
+ * Weighted least outstanding requests with the power of two choices:
+ * sample 2 eligible workers and take the one with the lowest busy/lbfactor.
+ * The busy counts are live, so bursts don't herd onto the node with the best
+ * lbstatus until the next recalculation. Returns NULL if the sampling didn't
+ * find any eligible worker: the caller falls back to the byrequests scan
+ * (it also handles the domains and the standby workers).
+ */
+static proxy_worker *internal_find_best_leastoutstanding(proxy_balancer *balancer, proxy_server_conf *conf,
+                                         request_rec *r,
+                                         proxy_vhost_table *vhost_table,
+                                         proxy_context_table *context_table, proxy_node_table *node_table)
+{
+    proxy_worker **workers = (proxy_worker **) balancer->workers->elts;
+    int nworkers = balancer->workers->nelts;
+    proxy_worker *candidate[2];
+    node_context *nodecontext[2];
+    nodehot_t *node[2];
+    int ncandidate = 0;
+    int tries;
+    apr_uint64_t rnd;
+
+    if (nworkers == 0)
+        return NULL;
+
+    /* create workers for new nodes */
+    update_workers_node(conf, r->pool, r->server, 1);
+
+    /* cheap per request randomness, no shared state to update */
+    rnd = hash_mix((apr_uint64_t) r->request_time ^ ((apr_uint64_t) r->connection->id << 32) ^ (apr_uint64_t) (apr_uintptr_t) r);
+    for (tries = 0; tries < 8 && ncandidate < 2; tries++) {
+        proxy_worker *worker;
+        node_context *context;
+        rnd = hash_mix(rnd + tries);
+        worker = workers[rnd % nworkers];
+        if (ncandidate == 1 && worker == candidate[0])
+            continue;
+        if ((context = worker_can_take(r, balancer, worker, &node[ncandidate], vhost_table, context_table, node_table)) == NULL)
+            continue;
+        candidate[ncandidate] = worker;
+        nodecontext[ncandidate] = context;
+        ncandidate++;
+    }
+    if (ncandidate == 0)
+        return NULL;
+    if (ncandidate == 2) {
+        /* busy0/lbfactor0 > busy1/lbfactor1 */
+        apr_uint64_t load0 = (apr_uint64_t) (candidate[0]->s->busy + 1) * effective_lbfactor(candidate[1], node[1]);
+        apr_uint64_t load1 = (apr_uint64_t) (candidate[1]->s->busy + 1) * effective_lbfactor(candidate[0], node[0]);
+        if (load0 > load1) {
+            candidate[0] = candidate[1];
+            nodecontext[0] = nodecontext[1];
+        }
+    }
+    candidate[0]->s->elected++;
+    apr_table_setn(r->subprocess_env, "BALANCER_CONTEXT_ID", apr_psprintf(r->pool, "%d", (*nodecontext[0]).context));
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
+                 "proxy: leastoutstanding balancer DONE (%s)", candidate[0]->s->name);
+    return candidate[0];
+}
+
+/*
+ * A node of the balancer came back or changed its load: wake the waiters
+ * of the balancer in this child and tell the other children.
+ */
+static void wake_waiters(const char *balancer)
+{
+    apr_hash_index_t *hi;
+
+    node_storage->signal_capacity();
+    if (!apr_atomic_read32(&local_waiting) || !wait_lock)
+        return;
+    apr_thread_mutex_lock(wait_lock);
+    for (hi = apr_hash_first(NULL, wait_queues); hi; hi = apr_hash_next(hi)) {
+        const char *name;
+        proxy_cluster_waitq *waitq;
+        proxy_cluster_waiter *waiter;
+        apr_hash_this(hi, (const void **) &name, NULL, (void **) &waitq);
+        /* the queues are by balancer->s->name: balancer://name */
+        if (strlen(name) <= 11 || strcasecmp(&name[11], balancer) != 0)
+            continue;
+        for (waiter = waitq->head; waiter; waiter = waiter->next) {
+            waiter->woken = 1;
+            apr_thread_cond_signal(waiter->cond);
+        }
+    }
+    apr_thread_mutex_unlock(wait_lock);
+}
+
+static proxy_worker *find_best_worker(proxy_balancer *balancer, proxy_server_conf *conf,
+                                      request_rec *r, const char *domain, int failoverdomain,
+                                      proxy_vhost_table *vhost_table,
+                                      proxy_context_table *context_table,
+                                      proxy_node_table *node_table,
+                                      int recurse);
+
+/*
+ * Wait up to the balancer timeout for a worker: a waiter rescans the
+ * workers when a node of its balancer changes in this child or when the
+ * capacity generation shows that another child saw a node change, never
+ * just because time passed.
+ */
+static proxy_worker *wait_for_worker(proxy_balancer *balancer, proxy_server_conf *conf,
+                                     request_rec *r, const char *domain, int failoverdomain,
+                                     proxy_vhost_table *vhost_table,
+                                     proxy_context_table *context_table,
+                                     proxy_node_table *node_table)
+{
+    proxy_worker *candidate = NULL;
+    proxy_cluster_waitq *waitq;
+    proxy_cluster_waiter *waiter, **prev;
+    apr_time_t start = apr_time_now();
+    apr_time_t deadline = start + balancer->s->timeout;
+    apr_interval_time_t step = balancer->s->timeout / 100;
+    apr_uint32_t generation;
+
+    if (!wait_lock)
+        return NULL;
+    if (step <= 0)
+        step = balancer->s->timeout;
+    waiter = apr_pcalloc(r->pool, sizeof(proxy_cluster_waiter));
+    if (apr_thread_cond_create(&waiter->cond, r->pool) != APR_SUCCESS)
+        return NULL;
+
+    apr_thread_mutex_lock(wait_lock);
+    waitq = apr_hash_get(wait_queues, balancer->s->name, APR_HASH_KEY_STRING);
+    if (waitq == NULL) {
+        waitq = apr_pcalloc(wait_pool, sizeof(proxy_cluster_waitq));
+        apr_hash_set(wait_queues, apr_pstrdup(wait_pool, balancer->s->name), APR_HASH_KEY_STRING, waitq);
+    }
+    if (wait_queue_size && waitq->depth >= wait_queue_size) {
+        apr_thread_mutex_unlock(wait_lock);
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
+                     "proxy: CLUSTER: (%s). Too many requests waiting for a worker",
+                     balancer->s->name);
+        return NULL;
+    }
+    if (waitq->tail)
+        waitq->tail->next = waiter;
+    else
+        waitq->head = waiter;
+    waitq->tail = waiter;
+    waitq->depth++;
+    apr_atomic_inc32(&local_waiting);
+    node_storage->wait_begin();
+    generation = node_storage->get_capacity_generation();
+
+    for (;;) {
+        apr_time_t now = apr_time_now();
+        apr_uint32_t current;
+        int woken;
+        if (now >= deadline)
+            break;
+        /* the other children can't signal us: check their generation every step */
+        apr_thread_cond_timedwait(waiter->cond, wait_lock, (deadline - now) < step ? (deadline - now) : step);
+        woken = waiter->woken;
+        waiter->woken = 0;
+        current = node_storage->get_capacity_generation();
+        if (!woken && current == generation)
+            continue;
+        generation = current;
+
+        apr_thread_mutex_unlock(wait_lock);
+        candidate = find_best_worker(balancer, conf, r, domain, failoverdomain, vhost_table, context_table, node_table, 0);
+        apr_thread_mutex_lock(wait_lock);
+        if (candidate)
+            break;
+    }
+
+    for (prev = &waitq->head; *prev != waiter; prev = &(*prev)->next)
+        ;
+    *prev = waiter->next;
+    if (waitq->tail == waiter) {
+        proxy_cluster_waiter *last = waitq->head;
+        while (last && last->next)
+            last = last->next;
+        waitq->tail = last;
+    }
+    waitq->depth--;
+    apr_atomic_dec32(&local_waiting);
+    apr_thread_mutex_unlock(wait_lock);
+    apr_thread_cond_destroy(waiter->cond);
+
+    node_storage->wait_end(apr_time_now() - start, candidate == NULL);
+    return candidate;
+}
+
 static proxy_worker *find_best_worker(proxy_balancer *balancer, proxy_server_conf *conf,
                                       request_rec *r, const char *domain, int failoverdomain,
                                       proxy_vhost_table *vhost_table,
@@ -2917,7 +4172,12 @@ static proxy_worker *find_best_worker(proxy_balancer *balancer, proxy_server_con
         return NULL;
     }
 
-    candidate = internal_find_best_byrequests(balancer, conf, r, domain, failoverdomain, vhost_table, context_table, node_table);
+    /* the domain preference and the deterministic failover need the byrequests scan */
+    if (lbmethod == LBMETHOD_LEASTOUTSTANDING && !(domain && *domain) &&
+        !(deterministic_failover && apr_table_get(r->notes, "session-id")))
+        candidate = internal_find_best_leastoutstanding(balancer, conf, r, vhost_table, context_table, node_table);
+    if (candidate == NULL)
+        candidate = internal_find_best_byrequests(balancer, conf, r, domain, failoverdomain, vhost_table, context_table, node_table);
 
     if ((rv = PROXY_THREAD_UNLOCK(balancer)) != APR_SUCCESS) {
         ap_log_error(APLOG_MARK, APLOG_ERR, rv, r->server,
@@ -2936,23 +4196,8 @@ static proxy_worker *find_best_worker(proxy_balancer *balancer, proxy_server_con
          */
 #if APR_HAS_THREADS
         if (balancer->s->timeout && recurse) {
-            /* XXX: This can perhaps be build using some
-             * smarter mechanism, like tread_cond.
-             * But since the statuses can came from
-             * different childs, use the provided algo.
-             */
-            apr_interval_time_t timeout = balancer->s->timeout;
-            apr_interval_time_t step, tval = 0;
-
-            step = timeout / 100;
-            while (tval < timeout) {
-                apr_sleep(step);
-                /* Try again */
-                if ((candidate = find_best_worker(balancer, conf, r,
-                		domain, failoverdomain, vhost_table, context_table, node_table, 0)))
-                    break;
-                tval += step;
-            }
+            candidate = wait_for_worker(balancer, conf, r, domain, failoverdomain,
+                                        vhost_table, context_table, node_table);
         }
 #endif
     }
@@ -3044,25 +4289,41 @@ static void remove_session_route(request_rec *r, const char *name)
                     *start = '\0';
                     cookies = apr_pstrcat(r->pool, cookie , end_cookie, NULL);
                     apr_table_setn(r->headers_in, "Cookie", cookies);
+                    /* the session ids must be split again */
+                    apr_table_unset(r->notes, "cluster-session-params");
                 }
             }
         }
     }
 }
 
+/*
+ * Decrement an active request counter, it never goes under 0
+ */
+static void dec_active_count(volatile apr_uint32_t *count)
+{
+    apr_uint32_t old;
+    do {
+        old = apr_atomic_read32(count);
+        if (old == 0)
+            return;
+    } while (apr_atomic_cas32(count, old - 1, old) != old);
+}
+
 /*
  * Update the context active request counter
- * Note: it need to lock the whole context table
+ * Note: the counter is updated atomically, no need to lock the context table
  */
 static void upd_context_count(const char *id, int val, server_rec *s)
 {
     int ident = atoi(id);
     contextinfo_t *context;
-    context_storage->lock_contexts();
     if (context_storage->read_context(ident, &context) == APR_SUCCESS) {
-        context->nbrequests = context->nbrequests + val;
+        if (val > 0)
+            apr_atomic_inc32(&context->nbrequests);
+        else
+            dec_active_count(&context->nbrequests);
     }
-    context_storage->unlock_contexts();
 }
 
 static apr_status_t decrement_busy_count(void *worker_)
@@ -3094,9 +4355,10 @@ static int proxy_cluster_pre_request(proxy_worker **worker,
     proxy_cluster_helper *helper;
     const char *context_id;
 
-    proxy_vhost_table *vhost_table = read_vhost_table(r);
-    proxy_context_table *context_table = read_context_table(r);
-    proxy_node_table *node_table = read_node_table(r);
+    proxy_cluster_snapshot *snap = get_snapshot(r);
+    proxy_vhost_table *vhost_table = &snap->vhost_table;
+    proxy_context_table *context_table = &snap->context_table;
+    proxy_node_table *node_table = &snap->node_table;
 
     *worker = NULL;
 #if HAVE_CLUSTER_EX_DEBUG
@@ -3118,12 +4380,11 @@ static int proxy_cluster_pre_request(proxy_worker **worker,
     if (*balancer) {
         /* Adjust the helper->count corresponding to the previous try */
         const char *worker_name =  apr_table_get(r->subprocess_env, "BALANCER_WORKER_NAME");
+        const char *worker_id = apr_table_get(r->notes, "cluster-worker-id");
         if (worker_name && *worker_name) {
-            int i;
-            int sizew = (*balancer)->workers->elt_size;
-            char *ptr = (*balancer)->workers->elts;
-            int def = ap_proxy_hashfunc(worker_name, PROXY_HASHFUNC_DEFAULT);
-            int fnv = ap_proxy_hashfunc(worker_name, PROXY_HASHFUNC_FNV);
+            proxy_cluster_server_conf *cconf = ap_get_module_config(r->server->module_config, &proxy_cluster_module);
+            proxy_worker_index *index = cconf->index;
+            int id = worker_id ? atoi(worker_id) : -1;
 #if HAVE_CLUSTER_EX_DEBUG
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                          "proxy_cluster_pre_request: worker %s", worker_name);
@@ -3133,17 +4394,12 @@ static int proxy_cluster_pre_request(proxy_worker **worker,
             if (context_id && *context_id) {
                upd_context_count(context_id, -1, r->server);
             }
-            apr_thread_mutex_lock(lock);
-            for (i = 0; i < (*balancer)->workers->nelts; i++, ptr=ptr+sizew) {
-                proxy_worker **run = (proxy_worker **) ptr;
-                if ((*run)->hash.def == def && (*run)->hash.fnv == fnv) {
-                    helper = (proxy_cluster_helper *) (*run)->context;
-                    if (helper->count_active>0)
-                        helper->count_active--;
-                    break;
-                }
+            /* the worker of the previous try by its node id */
+            if (index && id > 0 && id < index->size && index->workers[id] &&
+                strcmp(index->workers[id]->s->name, worker_name) == 0) {
+                helper = (proxy_cluster_helper *) index->workers[id]->context;
+                dec_active_count(&helper->count_active);
             }
-            apr_thread_mutex_unlock(lock);
         }
     }
 
@@ -3266,10 +4522,9 @@ static int proxy_cluster_pre_request(proxy_worker **worker,
     }
 
     /* Mark the worker used for the cleanup logic */
-    apr_thread_mutex_lock(lock);
     helper = (proxy_cluster_helper *) (*worker)->context;
-    helper->count_active++;
-    apr_thread_mutex_unlock(lock);
+    apr_atomic_inc32(&helper->count_active);
+    apr_table_setn(r->notes, "cluster-worker-id", apr_itoa(r->pool, helper->index));
 
     /*
      * get_route_balancer already fills all of the notes and some subprocess_env
@@ -3319,11 +4574,18 @@ static int proxy_cluster_post_request(proxy_worker *worker,
     }
 
     /* mark the worker as not in use */
-    apr_thread_mutex_lock(lock);
     helper = (proxy_cluster_helper *) worker->context;
-    helper->count_active--;
-
-    apr_thread_mutex_unlock(lock);
+    dec_active_count(&helper->count_active);
+
+    /* feed the outlier detection */
+    if (outlier_detection) {
+        nodehot_t *hot;
+        if (read_node_hot_worker(helper->index, &hot, worker) == APR_SUCCESS) {
+            apr_time_t elapsed = apr_time_now() - r->request_time;
+            update_ewma(&hot->ewma_latency, (apr_uint32_t) (elapsed > 0x7fffffff ? 0x7fffffff : elapsed));
+            update_ewma(&hot->ewma_errors, r->status >= HTTP_INTERNAL_SERVER_ERROR ? 65536 : 0);
+        }
+    }
 
 #if HAVE_CLUSTER_EX_DEBUG
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
@@ -3340,7 +4602,7 @@ static int proxy_cluster_post_request(proxy_worker *worker,
             sticky = apr_pstrdup(r->pool, balancer->s->sticky);
         }
         if (sticky != NULL) {
-            cookie = get_cookie_param(r, sticky, 0);
+            cookie = get_response_cookie(r, sticky);
             sessionid =  apr_table_get(r->notes, "session-id");
             route =  apr_table_get(r->notes, "session-route");
             if (cookie) {
@@ -3420,8 +4682,10 @@ static void proxy_cluster_hooks(apr_pool_t *p)
 {
     static const char * const aszPre[]={ "mod_manager.c", "mod_rewrite.c", NULL };
     static const char * const aszSucc[]={ "mod_proxy.c", NULL };
+    static const char * const aszManager[]={ "mod_manager.c", NULL };
 
-    ap_hook_post_config(proxy_cluster_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    /* after mod_manager: the shared tables must exist */
+    ap_hook_post_config(proxy_cluster_post_config, aszManager, NULL, APR_HOOK_MIDDLE);
 
     /* create the "maintenance" thread */
     ap_hook_child_init(proxy_cluster_child_init, NULL, NULL, APR_HOOK_LAST);
@@ -3447,9 +4711,10 @@ static void *create_proxy_cluster_dir_config(apr_pool_t *p, char *dir)
 }
  */
 
+/* only called for the VirtualHosts with a directive of the module, post_config does the others */
 static void *create_proxy_cluster_server_config(apr_pool_t *p, server_rec *s)
 {
-    return NULL;
+    return apr_pcalloc(p, sizeof(proxy_cluster_server_conf));
 }
 
 static const char*cmd_proxy_cluster_creatbal(cmd_parms *cmd, void *dummy, const char *arg)
@@ -3525,6 +4790,67 @@ static const char *cmd_proxy_cluster_deterministic_failover(cmd_parms *parms, vo
     return NULL;
 }
 
+static const char*cmd_proxy_cluster_lbmethod(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    if (strcasecmp(arg, "byrequests") == 0) {
+        lbmethod = LBMETHOD_BYREQUESTS;
+    } else if (strcasecmp(arg, "leastoutstanding") == 0) {
+        lbmethod = LBMETHOD_LEASTOUTSTANDING;
+    } else {
+        return "LoadBalancingMethod must be either byrequests or leastoutstanding";
+    }
+    return NULL;
+}
+
+static const char *cmd_proxy_cluster_outlier_detection(cmd_parms *parms, void *mconfig, int on)
+{
+    outlier_detection = on;
+    return NULL;
+}
+
+static const char*cmd_proxy_cluster_outlier_ejection_time(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    int val = atoi(arg);
+    if (val<1) {
+        return "OutlierEjectionTime must be greater than 0";
+    } else {
+        outlier_ejection_time = val;
+    }
+    return NULL;
+}
+static const char*cmd_proxy_cluster_slow_start(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    int val = atoi(arg);
+    if (val<0) {
+        return "SlowStart must be greater or equal to 0";
+    } else {
+        slow_start = val;
+    }
+    return NULL;
+}
+
+static const char*cmd_proxy_cluster_wait_queue_size(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    int val = atoi(arg);
+    if (val<0) {
+        return "WaitQueueSize must be greater or equal to 0";
+    } else {
+        wait_queue_size = val;
+    }
+    return NULL;
+}
+
+static const char*cmd_proxy_cluster_route_cache_size(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    int val = atoi(arg);
+    if (val<0) {
+        return "RouteCacheSize must be greater or equal to 0";
+    } else {
+        route_cache_size = val;
+    }
+    return NULL;
+}
+
 static const command_rec  proxy_cluster_cmds[] =
 {
     AP_INIT_TAKE1(
@@ -3570,6 +4896,48 @@ static const command_rec  proxy_cluster_cmds[] =
         OR_ALL,
         "DeterministicFailover - controls whether a node upon failover is chosen deterministically (Default: Off)"
     ),
+    AP_INIT_TAKE1(
+        "LoadBalancingMethod",
+        cmd_proxy_cluster_lbmethod,
+        NULL,
+        OR_ALL,
+        "LoadBalancingMethod - byrequests: lbstatus and requests since the last recalculation, leastoutstanding: best of 2 random nodes by busy/lbfactor (Default: byrequests)"
+    ),
+    AP_INIT_FLAG(
+        "OutlierDetection",
+        cmd_proxy_cluster_outlier_detection,
+        NULL,
+        OR_ALL,
+        "OutlierDetection - Stop sending new requests to the nodes that are much slower or return 5xx compared to the other nodes (Default: Off)"
+    ),
+    AP_INIT_TAKE1(
+        "OutlierEjectionTime",
+        cmd_proxy_cluster_outlier_ejection_time,
+        NULL,
+        OR_ALL,
+        "OutlierEjectionTime - Time in seconds a node is ejected, doubled for each consecutive ejection: (Default: 10 seconds)"
+    ),
+    AP_INIT_TAKE1(
+        "SlowStart",
+        cmd_proxy_cluster_slow_start,
+        NULL,
+        OR_ALL,
+        "SlowStart - Time in seconds to ramp the weight of a new or recovered node up to its load factor: (Default: 0 no ramp)"
+    ),
+    AP_INIT_TAKE1(
+        "WaitQueueSize",
+        cmd_proxy_cluster_wait_queue_size,
+        NULL,
+        OR_ALL,
+        "WaitQueueSize - Maximum number of requests of a child waiting for a free worker of a balancer (with a balancer timeout), 0: unlimited: (Default: 64)"
+    ),
+    AP_INIT_TAKE1(
+        "RouteCacheSize",
+        cmd_proxy_cluster_route_cache_size,
+        NULL,
+        OR_ALL,
+        "RouteCacheSize - Number of sticky routes a child keeps resolved, 0: no cache: (Default: 1024)"
+    ),
     {NULL}
 };
 